@@ -23,21 +23,38 @@ fn build_fmod_cpp_bridge(crate_root: &PathBuf, fmod_libs_path: &PathBuf) {
         "cargo:rustc-link-search=native={}",
         fmod_libs_path.to_str().unwrap()
     );
-    println!("cargo:rustc-link-lib=dylib=fmod");
-    println!("cargo:rustc-link-lib=dylib=fmodL");
+
+    // logging version of the library is slower, only use it when profiling
+    let profile = std::env::var_os("CARGO_FEATURE_PROFILE").is_some();
+    if profile {
+        println!("cargo:rustc-link-lib=dylib=fmodL");
+    } else {
+        println!("cargo:rustc-link-lib=dylib=fmod");
+    }
 
     // build C++ library & link it
     let rust_source = "src/bridge.rs";
     let cpp_dir = crate_root.join("src-cpp");
-    cxx_build::bridge(rust_source)
+    let mut build = cxx_build::bridge(rust_source);
+    build
         .file(cpp_dir.join("bridge.cpp"))
         .flag_if_supported("-std=c++17") // GCC
-        .flag_if_supported("/std:c++17") // MSVC
-        .compile("fmod_bridge");
+        .flag_if_supported("/std:c++17"); // MSVC
+    if profile {
+        build.define("BRIDGE_PROFILE", None);
+    }
+    build.compile("fmod_bridge");
 
     // rebuild if source files change
     println!("cargo:rerun-if-changed={}", rust_source);
-    for file in ["bridge.cpp", "bridge.h"] {
+    for file in [
+        "bridge.cpp",
+        "bridge.h",
+        "command_queue.h",
+        "pool_allocator.h",
+        "sha256.h",
+        "slot_map.h",
+    ] {
         println!(
             "cargo:rerun-if-changed={}",
             cpp_dir.join(file).to_str().unwrap()
@@ -0,0 +1,318 @@
+//! Measures cost of bridge calls with different numbers of objects.
+//!
+//! Runs headless, without an audio device:
+//! `cargo run --release --features bench --example bench`
+
+use bevy_fmod_simple::bridge::bridge;
+use std::time::{Duration, Instant};
+
+/// Frame time used to calculate how many calls fit into a frame
+const FRAME_TIME: Duration = Duration::from_micros(16_667);
+
+/// Number of objects to test with
+const COUNTS: &[usize] = &[100, 1000, 10_000];
+
+const SOUND_FILE: &[u8] = include_bytes!("../assets/Concrete 1.ogg");
+
+fn main() {
+    let mut bridge = bridge::create(bridge::InitParams {
+        max_virtual_channels: 4095,
+        max_active_channels: 64,
+        output_type: bridge::OutputType::NoSoundNrt,
+        update_thread_rate: 0.,
+        max_codecs: 0,
+        dsp_buffer_length: 0,
+        dsp_buffer_count: 0,
+        sample_rate: 0,
+        speaker_mode: bridge::SpeakerMode::Default,
+        enable_profiler: false,
+        memory_mode: bridge::MemoryMode::System,
+        memory_size: 0,
+        output_file: String::new(),
+    });
+    assert!(!bridge.is_null(), "failed to initialize bridge");
+
+    println!(
+        "{:<28} {:>7} {:>12} {:>12}",
+        "method", "N", "ns/op", "ops/frame"
+    );
+
+    for &count in COUNTS {
+        bench_sounds(bridge.pin_mut(), count);
+        bench_channels(bridge.pin_mut(), count);
+        bench_geometry(bridge.pin_mut(), count);
+    }
+}
+
+/// Prints time per call of `f`, which is called `count` times in total
+fn report(name: &str, count: usize, f: impl FnOnce()) {
+    let start = Instant::now();
+    f();
+    let per_op = start.elapsed() / count.max(1) as u32;
+
+    let ops_per_frame = FRAME_TIME.as_nanos() / per_op.as_nanos().max(1);
+    println!(
+        "{:<28} {:>7} {:>12} {:>12}",
+        name,
+        count,
+        per_op.as_nanos(),
+        ops_per_frame
+    );
+}
+
+fn bench_sounds(mut bridge: std::pin::Pin<&mut bridge::Bridge>, count: usize) {
+    let mut ids = Vec::with_capacity(count);
+
+    // first one is decoded, others are shared
+    report("load_audio_file (cached)", count, || {
+        for _ in 0..count {
+            ids.push(bridge.as_mut().load_audio_file(bridge::AudioFileParams {
+                file_contents: SOUND_FILE,
+                ..Default::default()
+            }));
+        }
+    });
+
+    report("free_audio_file", count, || {
+        for id in ids.drain(..) {
+            bridge.as_mut().free_audio_file(id);
+        }
+    });
+}
+
+fn bench_channels(mut bridge: std::pin::Pin<&mut bridge::Bridge>, count: usize) {
+    let sound = bridge.as_mut().load_audio_file(bridge::AudioFileParams {
+        file_contents: SOUND_FILE,
+        ..Default::default()
+    });
+    let mut ids = Vec::with_capacity(count);
+
+    report("play_channel", count, || {
+        for i in 0..count {
+            ids.push(bridge.as_mut().play_channel(channel_params(sound, i)));
+        }
+    });
+
+    report("update (N playing)", 1, || bridge.as_mut().update());
+
+    // mixer blocks per second of audio, so time is the cost of a block
+    let samples = 48_000;
+    let blocks = (samples + 1023) / 1024;
+    report("render (1 block, N playing)", blocks, || {
+        bridge.as_mut().render(samples as u32);
+    });
+
+    report("update_channel", count, || {
+        for (i, id) in ids.iter().enumerate() {
+            bridge
+                .as_mut()
+                .update_channel(*id, position_update(i).params);
+        }
+    });
+
+    let entries: Vec<_> = ids
+        .iter()
+        .enumerate()
+        .map(|(i, id)| bridge::ChannelBatchEntry {
+            id: *id,
+            ..position_update(i)
+        })
+        .collect();
+
+    report("update_channels_batch", count, || {
+        bridge.as_mut().update_channels_batch(&entries);
+    });
+
+    report("queue_channel_updates", count, || {
+        bridge.queue_channel_updates(&entries);
+    });
+
+    report("update (N queued)", 1, || bridge.as_mut().update());
+
+    report("is_playing_channel", count, || {
+        for id in &ids {
+            bridge.as_mut().is_playing_channel(*id);
+        }
+    });
+
+    report("collect_finished_channels", 1, || {
+        bridge.as_mut().collect_finished_channels();
+    });
+
+    report("free_channel", count, || {
+        for id in ids.drain(..) {
+            bridge.as_mut().free_channel(id);
+        }
+    });
+
+    let params: Vec<_> = (0..count).map(|i| channel_params(sound, i)).collect();
+
+    report("play_channels_batch", count, || {
+        ids.extend(bridge.as_mut().play_channels_batch(&params));
+    });
+
+    for id in ids.drain(..) {
+        bridge.as_mut().free_channel(id);
+    }
+
+    bridge.as_mut().update();
+    bridge.as_mut().free_audio_file(sound);
+}
+
+fn channel_params(sound: i32, i: usize) -> bridge::ChannelParams {
+    bridge::ChannelParams {
+        file_id: sound,
+        group_id: (i % 4) as i32,
+        priority: 128,
+        is_positional: true,
+        position: position(i),
+        velocity: Default::default(),
+        min_distance: 1.,
+        max_distance: 20.,
+        looped: true,
+        volume: 1.,
+        pitch: 1.,
+        startup_delay: 0,
+        start_clock: 0,
+        cooldown: 0,
+    }
+}
+
+fn bench_geometry(mut bridge: std::pin::Pin<&mut bridge::Bridge>, count: usize) {
+    let mut ids = Vec::with_capacity(count);
+
+    report("add_geometry (1 quad)", count, || {
+        for i in 0..count {
+            let p = position(i);
+            let vertex = |dx: f32, dz: f32| bridge::Vector {
+                x: p.x + dx,
+                y: p.y,
+                z: p.z + dz,
+            };
+            ids.push(bridge.as_mut().add_geometry(bridge::Geometry {
+                direct_occlusion: 0.5,
+                reverb_occlusion: 0.5,
+                polygons: vec![bridge::Polygon {
+                    vertices: vec![
+                        vertex(-1., -1.),
+                        vertex(1., -1.),
+                        vertex(1., 1.),
+                        vertex(-1., 1.),
+                    ],
+                }],
+            }));
+        }
+    });
+
+    report("free_geometry", count, || {
+        for id in ids.drain(..) {
+            bridge.as_mut().free_geometry(id);
+        }
+    });
+
+    let vertices: Vec<_> = (0..count)
+        .flat_map(|i| {
+            let p = position(i);
+            [(-1., -1.), (1., -1.), (1., 1.), (-1., 1.)].map(|(dx, dz)| bridge::Vector {
+                x: p.x + dx,
+                y: p.y,
+                z: p.z + dz,
+            })
+        })
+        .collect();
+    let polygon_sizes = [4];
+
+    report("add_geometry_flat (1 quad)", count, || {
+        for quad in vertices.chunks(4) {
+            ids.push(bridge.as_mut().add_geometry_flat(bridge::FlatGeometry {
+                direct_occlusion: 0.5,
+                reverb_occlusion: 0.5,
+                vertices: quad,
+                polygon_sizes: &polygon_sizes,
+            }));
+        }
+    });
+
+    for id in ids.drain(..) {
+        bridge.as_mut().free_geometry(id);
+    }
+
+    let quad =
+        [(-1., -1.), (1., -1.), (1., 1.), (-1., 1.)].map(|(x, z)| bridge::Vector { x, y: 0., z });
+    let prototype = bridge
+        .as_mut()
+        .add_geometry_prototype(bridge::FlatGeometry {
+            direct_occlusion: 0.5,
+            reverb_occlusion: 0.5,
+            vertices: &quad,
+            polygon_sizes: &polygon_sizes,
+        });
+
+    report("add_geometry_instance", count, || {
+        for i in 0..count {
+            ids.push(
+                bridge
+                    .as_mut()
+                    .add_geometry_instance(prototype, transform(i)),
+            );
+        }
+    });
+
+    report("update_geometry_transform", count, || {
+        for (i, id) in ids.iter().enumerate() {
+            let mut transform = transform(i);
+            transform.position.y = 1.;
+            bridge.as_mut().update_geometry_transform(*id, transform);
+        }
+    });
+
+    for id in ids.drain(..) {
+        bridge.as_mut().free_geometry(id);
+    }
+    bridge.as_mut().free_geometry_prototype(prototype);
+}
+
+fn transform(i: usize) -> bridge::GeometryTransform {
+    bridge::GeometryTransform {
+        position: position(i),
+        forward: bridge::Vector {
+            x: 0.,
+            y: 0.,
+            z: 1.,
+        },
+        up: bridge::Vector {
+            x: 0.,
+            y: 1.,
+            z: 0.,
+        },
+        scale: bridge::Vector {
+            x: 1.,
+            y: 1.,
+            z: 1.,
+        },
+    }
+}
+
+/// Objects are placed on a grid around the origin
+fn position(i: usize) -> bridge::Vector {
+    bridge::Vector {
+        x: (i % 100) as f32 - 50.,
+        y: 0.,
+        z: (i / 100) as f32 - 50.,
+    }
+}
+
+fn position_update(i: usize) -> bridge::ChannelBatchEntry {
+    let mut position = position(i);
+    position.y = 1.;
+
+    bridge::ChannelBatchEntry {
+        id: -1,
+        params: bridge::ChannelUpdateParams {
+            set_position: true,
+            position,
+            velocity: Default::default(),
+            ..Default::default()
+        },
+    }
+}
@@ -1,8 +1,16 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <cstdio>
 #include <cstdarg>
 #include <cstring>
+#include <string>
+#include <unordered_set>
 
 #include "bridge.h"
+#include "pool_allocator.h"
 #include "../fmod/include/fmod_errors.h"
 
 // I use __has_include so this cpp file can be viewed from C++ editor
@@ -62,23 +70,274 @@ static FMOD_VECTOR vector(Vector v) {
 	return {v.x, v.y, v.z};
 }
 
-// insert new item in sparse array (has vacant places with nullptr value) and return index
+static float length(FMOD_VECTOR v) {
+	return std::sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
+}
+
+static FMOD_VECTOR cross(FMOD_VECTOR a, FMOD_VECTOR b) {
+	return {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+// Vector is used as FMOD_VECTOR directly when passing arrays of vertices
+static_assert(sizeof(Vector) == sizeof(FMOD_VECTOR), "Vector must be layout-compatible with FMOD_VECTOR");
+static_assert(offsetof(Vector, x) == offsetof(FMOD_VECTOR, x), "Vector must be layout-compatible with FMOD_VECTOR");
+static_assert(offsetof(Vector, y) == offsetof(FMOD_VECTOR, y), "Vector must be layout-compatible with FMOD_VECTOR");
+static_assert(offsetof(Vector, z) == offsetof(FMOD_VECTOR, z), "Vector must be layout-compatible with FMOD_VECTOR");
+
+static const FMOD_VECTOR* vectors(const Vector* v) {
+	return reinterpret_cast<const FMOD_VECTOR*>(v);
+}
+
+// SHA-256 of data and salt
+static Sha256::Digest content_digest(const uint8_t* data, size_t size, uint8_t salt) {
+	Sha256 sha;
+	sha.add(&salt, 1);
+	sha.add(data, size);
+	return sha.finish();
+}
+
+// key in sound cache, never 0
+static uint64_t cache_key(const Sha256::Digest& digest) {
+	uint64_t key = 0;
+	std::memcpy(&key, digest.data(), sizeof(key));
+	return key ? key : 1;
+}
+
+// get object by ID, log error if ID is invalid
 template<typename T>
-int sparse_array_insert(std::vector<T*>& objects, T* new_object) {
-	size_t i=0; for (; i<objects.size(); ++i) if (!objects[i]) break; // find null
-	if (i == objects.size()) objects.emplace_back(); // no null, increase vector size
-	objects[i] = new_object;
-	return i;
+static T* find_object(SlotMap<T>& objects, int id, const char* type) {
+	auto object = objects.get(id);
+	if (!object)
+		error_msg("Invalid %s ID: %d", type, id);
+	return object;
+}
+
+// insert new object and return ID; release object if there is no space left
+template<typename T>
+static int insert_object(SlotMap<T*>& objects, T* new_object, const char* type) {
+	const int id = objects.insert(new_object);
+	if (id == -1) {
+		error_msg("Too many objects of type %s", type);
+		new_object->release();
+	}
+	return id;
+}
+
+// called by FMOD for all channels created by play_channel
+static FMOD_RESULT F_CALL channel_callback(
+	FMOD_CHANNELCONTROL* channelcontrol,
+	FMOD_CHANNELCONTROL_TYPE type,
+	FMOD_CHANNELCONTROL_CALLBACK_TYPE callbacktype,
+	void*, void*
+) {
+	// called when sound ends, is stopped or stolen
+	if (type != FMOD_CHANNELCONTROL_CHANNEL || callbacktype != FMOD_CHANNELCONTROL_CALLBACK_END)
+		return FMOD_OK;
+
+	auto channel = reinterpret_cast<FMOD::Channel*>(channelcontrol);
+
+	void* id = nullptr; // channel ID is stored as user data
+	FMOD::System* system = nullptr;
+	void* bridge = nullptr; // bridge is stored as user data of the system
+
+	if (channel->getUserData(&id) == FMOD_OK &&
+		channel->getSystemObject(&system) == FMOD_OK &&
+		system->getUserData(&bridge) == FMOD_OK)
+	{
+		static_cast<Bridge*>(bridge)->finished_channels.push_back(int(intptr_t(id)));
+	}
+	return FMOD_OK;
+}
+
+//
+
+#ifdef BRIDGE_PROFILE
+// Profiler zone which lasts until the end of the scope
+struct ProfilerZone {
+	explicit ProfilerZone(const char* name) { bridge_zone_begin(rust::Str(name)); }
+	~ProfilerZone() { bridge_zone_end(); }
+
+	ProfilerZone(const ProfilerZone&) = delete;
+	ProfilerZone& operator=(const ProfilerZone&) = delete;
+};
+#define PROFILER_ZONE(name) ProfilerZone profiler_zone_(name)
+
+/// Forwards log of the logging FMOD library
+static FMOD_RESULT F_CALL debug_callback(FMOD_DEBUG_FLAGS flags, const char* file, int line, const char* func, const char* message) {
+	int n = strlen(message);
+	if (n && message[n - 1] == '\n')
+		--n; // FMOD messages have trailing newline
+
+	if (flags & FMOD_DEBUG_LEVEL_ERROR)
+		error_msg("FMOD (%s:%d): %.*s", file, line, n, message);
+	else
+		info_msg("FMOD (%s:%d): %.*s", file, line, n, message);
+	return FMOD_OK;
+}
+#else
+#define PROFILER_ZONE(name)
+#endif
+
+//
+// File callbacks, used to read files via Rust (see AudioFileParams::use_file_callbacks).
+// FMOD calls them from its file thread for streams and non-blocking sounds,
+// so Rust side may block.
+
+static FMOD_RESULT F_CALL file_open_callback(const char* name, unsigned int* filesize, void** handle, void*) {
+	uint32_t size = 0;
+	const uint64_t rust_handle = bridge_file_open(rust::Str(name), size);
+	if (!rust_handle)
+		return FMOD_ERR_FILE_NOTFOUND;
+
+	*filesize = size;
+	*handle = reinterpret_cast<void*>(uintptr_t(rust_handle));
+	return FMOD_OK;
+}
+
+static FMOD_RESULT F_CALL file_close_callback(void* handle, void*) {
+	bridge_file_close(uint64_t(reinterpret_cast<uintptr_t>(handle)));
+	return FMOD_OK;
+}
+
+// Async reads which are started but not finished yet, see file_read_done
+static std::mutex file_requests_mutex;
+static std::condition_variable file_request_finished;
+static std::unordered_set<FMOD_ASYNCREADINFO*> file_requests;
+
+// Called from FMOD file thread; Rust reads data in its own task and calls file_read_done,
+// so the thread isn't blocked and can serve other streams meanwhile
+static FMOD_RESULT F_CALL file_async_read_callback(FMOD_ASYNCREADINFO* info, void*) {
+	{
+		std::lock_guard lock(file_requests_mutex);
+		file_requests.insert(info);
+	}
+	bridge_file_read_async(uint64_t(reinterpret_cast<uintptr_t>(info->handle)), size_t(info), info->offset, info->sizebytes);
+	return FMOD_OK;
+}
+
+// Request can't be removed from the Rust task, so this waits until the read is finished.
+// FMOD may free the info after this returns.
+static FMOD_RESULT F_CALL file_async_cancel_callback(FMOD_ASYNCREADINFO* info, void*) {
+	std::unique_lock lock(file_requests_mutex);
+	file_request_finished.wait(lock, [info] { return !file_requests.count(info); });
+	return FMOD_OK;
+}
+
+void file_read_done(size_t request, rust::Slice<const uint8_t> data, bool ok) {
+	auto info = reinterpret_cast<FMOD_ASYNCREADINFO*>(request);
+	std::lock_guard lock(file_requests_mutex);
+	if (!file_requests.erase(info)) {
+		error_msg("Unknown file read request");
+		return;
+	}
+
+	const size_t size = std::min(data.size(), size_t(info->sizebytes));
+	std::memcpy(info->buffer, data.data(), size);
+	info->bytesread = size;
+
+	FMOD_RESULT result = FMOD_OK;
+	if (!ok)
+		result = FMOD_ERR_FILE_BAD;
+	else if (size < info->sizebytes)
+		result = FMOD_ERR_FILE_EOF;
+	info->done(info, result);
+
+	file_request_finished.notify_all();
+}
+
+// called by FMOD thread when sound created with FMOD_NONBLOCKING is loaded (or failed to),
+// and after non-blocking seeks of streams
+static FMOD_RESULT F_CALL sound_loaded_callback(FMOD_SOUND*, FMOD_RESULT) {
+	bridge_sound_loaded();
+	return FMOD_OK;
 }
 
 //
+// Memory setup (see InitParams::memory_mode).
+// It's global for FMOD and can be done only once, before the first system is created;
+// pool and allocator are never freed, since FMOD may use them until the process exits.
+
+static PoolAllocator* memory_allocator = nullptr;
+
+static void* F_CALL memory_alloc_callback(unsigned int size, FMOD_MEMORY_TYPE, const char*) {
+	return memory_allocator->alloc(size);
+}
+
+static void* F_CALL memory_realloc_callback(void* ptr, unsigned int size, FMOD_MEMORY_TYPE, const char*) {
+	return memory_allocator->realloc(ptr, size);
+}
+
+static void F_CALL memory_free_callback(void* ptr, FMOD_MEMORY_TYPE, const char*) {
+	memory_allocator->free(ptr);
+}
+
+static bool init_memory(MemoryMode mode, unsigned int size) {
+	static bool initialized = false;
+	static MemoryMode initialized_mode = MemoryMode::System;
+	static unsigned int initialized_size = 0;
+
+	if (initialized) {
+		if (mode != initialized_mode || size != initialized_size)
+			error_msg("FMOD memory settings can't be changed after first initialization");
+		return true;
+	}
+
+	FMOD_RESULT result = FMOD_OK;
+	switch (mode) {
+	case MemoryMode::Pool: {
+		// must be multiple of 512 bytes
+		const int pool_size = int(std::min(size, 0x7fffffffu) & ~511u);
+		void* pool = pool_size ? std::malloc(pool_size) : nullptr;
+		if (!pool) {
+			error_msg("Can't allocate FMOD memory pool of %d bytes", pool_size);
+			return false;
+		}
+		result = FMOD::Memory_Initialize(pool, pool_size, nullptr, nullptr, nullptr);
+		if (!ERRCHECK(result)) {
+			std::free(pool);
+			return false;
+		}
+		info_msg("FMOD uses fixed memory pool of %d bytes", pool_size);
+		break;
+	}
+
+	case MemoryMode::Allocator:
+		memory_allocator = new PoolAllocator(size);
+		result = FMOD::Memory_Initialize(nullptr, 0, memory_alloc_callback, memory_realloc_callback, memory_free_callback);
+		if (!ERRCHECK(result)) {
+			delete memory_allocator;
+			memory_allocator = nullptr;
+			return false;
+		}
+		if (size)
+			info_msg("FMOD uses pool allocator limited to %u bytes", size);
+		break;
+
+	default:
+		break;
+	}
+
+	initialized = true;
+	initialized_mode = mode;
+	initialized_size = size;
+	return true;
+}
 
 bool Bridge::init(InitParams params) {
+	PROFILER_ZONE("Bridge::init");
 	//
 	// library initialization
 
 	info_msg("FMOD static library version: %d.%d.%d", FMOD_VERSION >> 16, (FMOD_VERSION >> 8) & 0xff, FMOD_VERSION & 0xff);
 
+#ifdef BRIDGE_PROFILE
+	result = FMOD::Debug_Initialize(FMOD_DEBUG_LEVEL_WARNING, FMOD_DEBUG_MODE_CALLBACK, debug_callback);
+	ERRCHECK(result);
+#endif
+
+	if (!init_memory(params.memory_mode, params.memory_size))
+		return false;
+
 	result = FMOD::System_Create(&system);
 	if (!ERRCHECK(result))
 		return false;
@@ -89,276 +348,1509 @@ bool Bridge::init(InitParams params) {
 	if (fmod_version != FMOD_VERSION)
 		error_msg("FMOD dynamic library version differs! It is %d.%d.%d", fmod_version >> 16, (fmod_version >> 8) & 0xff, fmod_version & 0xff);
 
+	result = system->setUserData(this); // used by callbacks
+	ERRCHECK(result);
+
 	result = system->setSoftwareChannels(params.max_active_channels); // MUST be called before system->init!
 	ERRCHECK(result);
 
+	if (params.output_type != OutputType::Default) {
+		auto output = FMOD_OUTPUTTYPE_AUTODETECT;
+		switch (params.output_type) {
+		case OutputType::NoSound: output = FMOD_OUTPUTTYPE_NOSOUND; break;
+		case OutputType::NoSoundNrt: output = FMOD_OUTPUTTYPE_NOSOUND_NRT; break;
+		case OutputType::WavWriterNrt: output = FMOD_OUTPUTTYPE_WAVWRITER_NRT; break;
+		case OutputType::Wasapi: output = FMOD_OUTPUTTYPE_WASAPI; break;
+		case OutputType::Asio: output = FMOD_OUTPUTTYPE_ASIO; break;
+		case OutputType::PulseAudio: output = FMOD_OUTPUTTYPE_PULSEAUDIO; break;
+		case OutputType::Alsa: output = FMOD_OUTPUTTYPE_ALSA; break;
+		case OutputType::CoreAudio: output = FMOD_OUTPUTTYPE_COREAUDIO; break;
+		default: break;
+		}
+
+		result = system->setOutput(output); // also must be called before init
+		ERRCHECK(result);
+	}
+
+	// mixer settings, must be set before init too
+
+	if (params.dsp_buffer_length || params.dsp_buffer_count) {
+		unsigned int length = 0;
+		int count = 0;
+
+		result = system->getDSPBufferSize(&length, &count);
+		ERRCHECK(result);
+
+		if (params.dsp_buffer_length)
+			length = params.dsp_buffer_length;
+		if (params.dsp_buffer_count > 0)
+			count = params.dsp_buffer_count;
+
+		result = system->setDSPBufferSize(length, count);
+		ERRCHECK(result);
+	}
+
+	if (params.sample_rate > 0 || params.speaker_mode != SpeakerMode::Default) {
+		int sample_rate = 0;
+		FMOD_SPEAKERMODE speaker_mode = FMOD_SPEAKERMODE_DEFAULT;
+
+		result = system->getSoftwareFormat(&sample_rate, &speaker_mode, nullptr);
+		ERRCHECK(result);
+
+		if (params.sample_rate > 0)
+			sample_rate = params.sample_rate;
+
+		switch (params.speaker_mode) {
+		case SpeakerMode::Mono: speaker_mode = FMOD_SPEAKERMODE_MONO; break;
+		case SpeakerMode::Stereo: speaker_mode = FMOD_SPEAKERMODE_STEREO; break;
+		case SpeakerMode::Quad: speaker_mode = FMOD_SPEAKERMODE_QUAD; break;
+		case SpeakerMode::Surround: speaker_mode = FMOD_SPEAKERMODE_SURROUND; break;
+		case SpeakerMode::Surround51: speaker_mode = FMOD_SPEAKERMODE_5POINT1; break;
+		case SpeakerMode::Surround71: speaker_mode = FMOD_SPEAKERMODE_7POINT1; break;
+		default: break;
+		}
+
+		result = system->setSoftwareFormat(sample_rate, speaker_mode, 0);
+		ERRCHECK(result);
+	}
+
+	if (params.max_codecs > 0) {
+		// Codecs for compressed samples are preallocated; each playing compressed sample
+		// uses one, so this also limits CPU spent on decoding them.
+		FMOD_ADVANCEDSETTINGS settings = {};
+		settings.cbSize = sizeof(FMOD_ADVANCEDSETTINGS);
+
+		result = system->getAdvancedSettings(&settings);
+		ERRCHECK(result);
+
+		settings.maxMPEGCodecs = params.max_codecs;
+		settings.maxADPCMCodecs = params.max_codecs;
+		settings.maxXMACodecs = params.max_codecs;
+		settings.maxVorbisCodecs = params.max_codecs;
+		settings.maxAT9Codecs = params.max_codecs;
+		settings.maxFADPCMCodecs = params.max_codecs;
+		settings.maxOpusCodecs = params.max_codecs;
+
+		result = system->setAdvancedSettings(&settings); // must be called before init
+		ERRCHECK(result);
+	}
+
+	// Non-realtime output mixes one block per update. Streams are decoded on update too,
+	// instead of a separate thread, so they never lag behind the mixer
+	is_nrt_output = params.output_type == OutputType::NoSoundNrt || params.output_type == OutputType::WavWriterNrt;
+
+	// WAV writer takes file name as driver data
+	const std::string output_file(params.output_file);
+	void* driver_data = nullptr;
+	if (params.output_type == OutputType::WavWriterNrt && !output_file.empty())
+		driver_data = const_cast<char*>(output_file.c_str());
+
 	result = system->init(
 		params.max_virtual_channels,
 		FMOD_INIT_NORMAL |
 			FMOD_INIT_CHANNEL_LOWPASS | // required for 3D geometry occlusion?
 			FMOD_INIT_VOL0_BECOMES_VIRTUAL | // disables playback for sounds which have near-0 volume
-			FMOD_INIT_3D_RIGHTHANDED, // same coordinate system bevy uses
-		nullptr
+			FMOD_INIT_3D_RIGHTHANDED | // same coordinate system bevy uses
+			(params.enable_profiler ? FMOD_INIT_PROFILE_ENABLE : 0) |
+			(is_nrt_output ? FMOD_INIT_STREAM_FROM_UPDATE | FMOD_INIT_MIX_FROM_UPDATE : 0),
+		driver_data
 	);
 	if (!ERRCHECK(result))
 		return false;
 	
+	{
+		unsigned int length = 0;
+		int count = 0;
+
+		result = system->getDSPBufferSize(&length, &count);
+		ERRCHECK(result);
+
+		result = system->getSoftwareFormat(&sample_rate, nullptr, nullptr);
+		ERRCHECK(result);
+
+		if (sample_rate > 0)
+			info_msg("Mixer: %d Hz, %d buffers of %u samples, latency %.1f ms", sample_rate, count, length, 1000. * length * count / sample_rate);
+	}
+
 	//
 	// apply settings
 
+	set_virtual_volume(vol0virtualvol); // until update_engine is called
+	begin_frame_clock();
+
+	//
+	// start update thread
+
+	if (params.update_thread_rate > 0) {
+		const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1. / params.update_thread_rate));
+
+		use_update_thread = true; // must be set before thread is started
+		update_thread = std::thread([this, period] {
+			auto next_update = std::chrono::steady_clock::now();
+			while (!stop_update_thread.load(std::memory_order_relaxed)) {
+				{
+					std::lock_guard<std::recursive_mutex> lock(state_mutex);
+					update_system();
+				}
+
+				next_update += period;
+				const auto now = std::chrono::steady_clock::now();
+				if (next_update < now)
+					next_update = now; // don't try to catch up after a stall
+				std::this_thread::sleep_until(next_update);
+			}
+		});
+	}
+
+	return true;
+}
+
+Bridge::~Bridge() {
+	if (update_thread.joinable()) {
+		stop_update_thread = true;
+		update_thread.join();
+	}
+
+	for (auto& slot : reverb_slots)
+		slot.reverb->release();
+
+	geometries.for_each([](int, GeometryEntry& entry) {
+		entry.geometry->release();
+		if (entry.proxy)
+			entry.proxy->release();
+	});
+
+	channels.for_each([](int, FMOD::Channel* channel) {
+		channel->stop();
+	});
+
+	sounds.for_each([](int, SoundEntry& entry) {
+		entry.sound->release();
+	});
+
+	for (auto& group : groups) {
+		remove_group_dsp(group, group.lowpass);
+		remove_group_dsp(group, group.compressor);
+		if (group.group)
+			group.group->release();
+	}
+
+	result = system->close();
+	ERRCHECK(result);
+	
+	result = system->release();
+	ERRCHECK(result);
+}
+
+GroupEntry& Bridge::get_group(int user_id) {
+	if (!check_group_id(user_id))
+		user_id = 0;
+
+	if (size_t(user_id) >= groups.size() || !groups[user_id].group) { // create group with default parameters if it doesn't exist
+		GroupParams params;
+		params.user_id = user_id;
+		params.volume = 1.;
+		params.max_instances = 0;
+		params.virtual_volume = 0;
+		params.parent_id = -1;
+		params.lowpass_cutoff = 0;
+		params.compressor_ratio = 1;
+		params.compressor_threshold = 0;
+		params.compressor_attack = 20;
+		params.compressor_release = 100;
+		params.sidechain_group_id = -1;
+		update_group(params);
+	}
+
+	if (size_t(user_id) >= groups.size())
+		groups.resize(user_id + 1); // update_group failed; FMOD uses master group for null
+	return groups[user_id];
+}
+
+bool Bridge::check_group_id(int user_id) {
+	if (user_id < 0 || user_id >= max_groups) {
+		error_msg("Invalid group ID: %d (must be in [0; %d) range)", user_id, max_groups);
+		return false;
+	}
+	return true;
+}
+
+void Bridge::update_group_dsp(GroupEntry& entry, const GroupParams& params) {
+	// effects are added at the input end of the chain, before the group fader
+
+	if (params.lowpass_cutoff > 0) {
+		if (!entry.lowpass) {
+			result = system->createDSPByType(FMOD_DSP_TYPE_LOWPASS_SIMPLE, &entry.lowpass);
+			if (!ERRCHECK(result))
+				entry.lowpass = nullptr;
+			else {
+				result = entry.group->addDSP(FMOD_CHANNELCONTROL_DSP_TAIL, entry.lowpass);
+				if (!ERRCHECK(result)) {
+					entry.lowpass->release();
+					entry.lowpass = nullptr;
+				}
+			}
+		}
+		if (entry.lowpass) {
+			result = entry.lowpass->setParameterFloat(FMOD_DSP_LOWPASS_SIMPLE_CUTOFF, params.lowpass_cutoff);
+			ERRCHECK(result);
+		}
+	}
+	else
+		remove_group_dsp(entry, entry.lowpass);
+
+	if (params.compressor_ratio > 1) {
+		if (!entry.compressor) {
+			result = system->createDSPByType(FMOD_DSP_TYPE_COMPRESSOR, &entry.compressor);
+			if (!ERRCHECK(result))
+				entry.compressor = nullptr;
+			else {
+				result = entry.group->addDSP(FMOD_CHANNELCONTROL_DSP_TAIL, entry.compressor);
+				if (!ERRCHECK(result)) {
+					entry.compressor->release();
+					entry.compressor = nullptr;
+				}
+			}
+		}
+		if (entry.compressor) {
+			result = entry.compressor->setParameterFloat(FMOD_DSP_COMPRESSOR_THRESHOLD, params.compressor_threshold);
+			ERRCHECK(result);
+			result = entry.compressor->setParameterFloat(FMOD_DSP_COMPRESSOR_RATIO, params.compressor_ratio);
+			ERRCHECK(result);
+			result = entry.compressor->setParameterFloat(FMOD_DSP_COMPRESSOR_ATTACK, params.compressor_attack);
+			ERRCHECK(result);
+			result = entry.compressor->setParameterFloat(FMOD_DSP_COMPRESSOR_RELEASE, params.compressor_release);
+			ERRCHECK(result);
+
+			if (params.sidechain_group_id != entry.sidechain_id)
+				set_group_sidechain(entry, params.sidechain_group_id);
+		}
+	}
+	else
+		remove_group_dsp(entry, entry.compressor);
+}
+
+void Bridge::remove_group_dsp(GroupEntry& entry, FMOD::DSP*& dsp) {
+	if (!dsp)
+		return;
+
+	if (dsp == entry.compressor) {
+		entry.sidechain_id = -1; // connection is removed together with DSP
+		entry.sidechain_input = nullptr;
+	}
+
+	result = entry.group->removeDSP(dsp);
+	ERRCHECK(result);
+
+	result = dsp->release();
+	ERRCHECK(result);
+
+	dsp = nullptr;
+}
+
+void Bridge::set_group_sidechain(GroupEntry& entry, int sidechain_id) {
+	if (entry.sidechain_input) {
+		result = entry.compressor->disconnectFrom(entry.sidechain_input);
+		ERRCHECK(result);
+		entry.sidechain_id = -1;
+		entry.sidechain_input = nullptr;
+	}
+
+	FMOD_DSP_PARAMETER_SIDECHAIN sidechain = {};
+
+	if (sidechain_id != -1 && groups[sidechain_id].group) {
+		FMOD::DSP* input = nullptr;
+		result = groups[sidechain_id].group->getDSP(FMOD_CHANNELCONTROL_DSP_HEAD, &input);
+		if (ERRCHECK(result)) {
+			// only used as compressor's control signal, not mixed into output
+			result = entry.compressor->addInput(input, nullptr, FMOD_DSPCONNECTION_TYPE_SIDECHAIN);
+			if (ERRCHECK(result)) {
+				entry.sidechain_id = sidechain_id;
+				entry.sidechain_input = input;
+				sidechain.sidechainenable = true;
+			}
+		}
+	}
+
+	result = entry.compressor->setParameterData(FMOD_DSP_COMPRESSOR_USESIDECHAIN, &sidechain, sizeof(sidechain));
+	ERRCHECK(result);
+}
+
+float Bridge::total_group_volume(const GroupEntry& group) {
+	float volume = group.volume * master_volume;
+	for (int i = group.parent_id; i != -1; i = groups[i].parent_id) // there are no cycles, see update_group
+		volume *= groups[i].volume;
+	return volume;
+}
+	
+// state of sound created with FMOD_NONBLOCKING
+static LoadState open_state(FMOD::Sound* sound) {
+	FMOD_OPENSTATE state = FMOD_OPENSTATE_READY;
+	const FMOD_RESULT result = sound->getOpenState(&state, nullptr, nullptr, nullptr);
+	if (!ERRCHECK(result)) // if loading failed, this is the error
+		return LoadState::Error;
+
+	switch (state) {
+	case FMOD_OPENSTATE_LOADING:
+	case FMOD_OPENSTATE_CONNECTING:
+		return LoadState::Loading;
+	case FMOD_OPENSTATE_ERROR:
+		return LoadState::Error;
+	default: // streams have other states during playback
+		return LoadState::Ready;
+	}
+}
+
+LoadState Bridge::check_load_state(SoundEntry& entry) {
+	if (!entry.loading)
+		return LoadState::Ready;
+
+	const auto state = open_state(entry.sound);
+	if (state != LoadState::Ready)
+		return state;
+
+	entry.loading = false;
+	if (!entry.keep_buffer)
+		entry.buffer = {}; // not needed by loaded sound
+
+	apply_sound_template(entry); // could've been added while loading
+
+	return LoadState::Ready;
+}
+
+void Bridge::apply_sound_template(SoundEntry& entry) {
+	if (entry.loading)
+		return; // sound can't be changed yet, template is applied when it's ready
+
+	auto templ = sound_templates.get(entry.template_id);
+	if (!templ)
+		return;
+	const auto& params = templ->defaults;
+	auto& current = entry.defaults;
+
+	// on error entry keeps old value, so channels which need the parameter will still set it
+
+	if (params.is_positional != current.is_positional) {
+		result = entry.sound->setMode(params.is_positional ? FMOD_3D : FMOD_2D);
+		if (ERRCHECK(result))
+			current.is_positional = params.is_positional;
+	}
+
+	if (params.min_distance != current.min_distance || params.max_distance != current.max_distance) {
+		result = entry.sound->set3DMinMaxDistance(params.min_distance, params.max_distance);
+		if (ERRCHECK(result)) {
+			current.min_distance = params.min_distance;
+			current.max_distance = params.max_distance;
+		}
+	}
+
+	if (params.looped != current.looped) {
+		result = entry.sound->setLoopCount(params.looped ? -1 : 0);
+		if (ERRCHECK(result))
+			current.looped = params.looped;
+	}
+
+	if (params.priority != current.priority) {
+		float frequency = 0;
+		result = entry.sound->getDefaults(&frequency, nullptr);
+		if (ERRCHECK(result)) {
+			result = entry.sound->setDefaults(frequency, params.priority);
+			if (ERRCHECK(result))
+				current.priority = params.priority;
+		}
+	}
+}
+
+FMOD::Geometry* Bridge::create_geometry(const Geometry& params) {
+	int vertex_count = 0;
+	for (auto& polygon : params.polygons)
+		vertex_count += polygon.vertices.size();
+
+	// info_msg("Adding geometry: %d polygons, %d vertices", int(params.polygons.size()), vertex_count);
+
+	FMOD::Geometry* geometry = nullptr;
+	result = system->createGeometry(params.polygons.size(), vertex_count, &geometry);
+	if (!ERRCHECK(result))
+		return nullptr;
+
+	for (auto& polygon : params.polygons) {
+		int polygon_index = 0; // unused value
+		result = geometry->addPolygon(params.direct_occlusion, params.reverb_occlusion, true, polygon.vertices.size(), vectors(polygon.vertices.data()), &polygon_index);
+		ERRCHECK(result);
+	}
+
+	return geometry;
+}
+
+FMOD::Geometry* Bridge::create_geometry(const FlatGeometry& params) {
+	size_t vertex_count = 0;
+	for (auto size : params.polygon_sizes) {
+		if (size < 3) {
+			error_msg("Invalid geometry: polygon has %u vertices", size);
+			return nullptr;
+		}
+		vertex_count += size;
+	}
+	if (vertex_count != params.vertices.size()) {
+		error_msg("Invalid geometry: polygons have %d vertices, but %d are provided", int(vertex_count), int(params.vertices.size()));
+		return nullptr;
+	}
+
+	FMOD::Geometry* geometry = nullptr;
+	result = system->createGeometry(params.polygon_sizes.size(), vertex_count, &geometry);
+	if (!ERRCHECK(result))
+		return nullptr;
+
+	auto vertices = vectors(params.vertices.data());
+	for (auto size : params.polygon_sizes) {
+		int polygon_index = 0; // unused value
+		result = geometry->addPolygon(params.direct_occlusion, params.reverb_occlusion, true, size, vertices, &polygon_index);
+		ERRCHECK(result);
+		vertices += size;
+	}
+
+	return geometry;
+}
+
+std::vector<char> Bridge::save_geometry(const FlatGeometry& params) {
+	auto geometry = create_geometry(params);
+	if (!geometry)
+		return {};
+
+	result = geometry->setActive(false); // it won't be used in the world, just in case
+	ERRCHECK(result);
+
+	std::vector<char> data;
+	int size = 0;
+
+	result = geometry->save(nullptr, &size);
+	if (ERRCHECK(result)) {
+		data.resize(size);
+		result = geometry->save(data.data(), &size);
+		if (!ERRCHECK(result))
+			data.clear();
+	}
+
+	result = geometry->release();
+	ERRCHECK(result);
+
+	return data;
+}
+
+FMOD::Geometry* Bridge::load_geometry(const std::vector<char>& data) {
+	FMOD::Geometry* geometry = nullptr;
+	result = system->loadGeometry(data.data(), data.size(), &geometry);
+	if (!ERRCHECK(result))
+		return nullptr;
+	return geometry;
+}
+
+int Bridge::insert_geometry(FMOD::Geometry* geometry) {
+	GeometryEntry entry;
+	entry.geometry = geometry;
+
+	// calculate bounds from vertices, which are returned in local space
+	FMOD_VECTOR min = {}, max = {};
+	bool has_vertices = false;
+
+	int polygon_count = 0;
+	result = geometry->getNumPolygons(&polygon_count);
+	ERRCHECK(result);
+
+	for (int i = 0; i < polygon_count; ++i) {
+		int vertex_count = 0;
+		result = geometry->getPolygonNumVertices(i, &vertex_count);
+		if (!ERRCHECK(result))
+			continue;
+
+		for (int j = 0; j < vertex_count; ++j) {
+			FMOD_VECTOR v;
+			result = geometry->getPolygonVertex(i, j, &v);
+			if (!ERRCHECK(result))
+				continue;
+
+			if (!has_vertices) {
+				min = max = v;
+				has_vertices = true;
+			}
+			min = {std::min(min.x, v.x), std::min(min.y, v.y), std::min(min.z, v.z)};
+			max = {std::max(max.x, v.x), std::max(max.y, v.y), std::max(max.z, v.z)};
+		}
+	}
+
+	entry.local_center = {(min.x + max.x) / 2, (min.y + max.y) / 2, (min.z + max.z) / 2};
+	entry.local_radius = length({max.x - entry.local_center.x, max.y - entry.local_center.y, max.z - entry.local_center.z});
+
+	const int id = geometries.insert(entry);
+	if (id == -1) {
+		error_msg("Too many objects of type geometry");
+		geometry->release();
+	}
+	return id;
+}
+
+void Bridge::set_geometry_transform(GeometryEntry& entry, const GeometryTransform& transform) {
+	entry.position = vector(transform.position);
+	entry.forward = vector(transform.forward);
+	entry.up = vector(transform.up);
+	entry.scale = vector(transform.scale);
+
+	for (auto geometry : {entry.geometry, entry.proxy}) {
+		if (!geometry)
+			continue;
+
+		result = geometry->setPosition(&entry.position);
+		ERRCHECK(result);
+
+		result = geometry->setRotation(&entry.forward, &entry.up);
+		ERRCHECK(result);
+
+		result = geometry->setScale(&entry.scale);
+		ERRCHECK(result);
+	}
+}
+
+void Bridge::update_geometry_lod(GeometryEntry& entry) {
+	// bounding sphere in world space
+	auto& c = entry.local_center;
+	auto& s = entry.scale;
+	auto right = cross(entry.up, entry.forward);
+	FMOD_VECTOR center = {
+		entry.position.x + right.x * c.x * s.x + entry.up.x * c.y * s.y + entry.forward.x * c.z * s.z,
+		entry.position.y + right.y * c.x * s.x + entry.up.y * c.y * s.y + entry.forward.y * c.z * s.z,
+		entry.position.z + right.z * c.x * s.x + entry.up.z * c.y * s.y + entry.forward.z * c.z * s.z,
+	};
+	const float radius = entry.local_radius * std::max({std::abs(s.x), std::abs(s.y), std::abs(s.z)});
+
+	const float distance = listener_distance(center) - radius;
+
+	int lod = 0;
+	if (entry.cull_distance > 0 && distance >= entry.cull_distance)
+		lod = 2;
+	else if (entry.proxy && distance >= entry.proxy_distance)
+		lod = 1;
+
+	if (lod == entry.lod)
+		return;
+	entry.lod = lod;
+
+	result = entry.geometry->setActive(lod == 0);
+	ERRCHECK(result);
+
+	if (entry.proxy) {
+		result = entry.proxy->setActive(lod == 1);
+		ERRCHECK(result);
+	}
+}
+
+void Bridge::set_virtual_volume(float volume) {
 	FMOD_ADVANCEDSETTINGS settings = {};
 	settings.cbSize = sizeof(FMOD_ADVANCEDSETTINGS);
 
-	result = system->getAdvancedSettings(&settings);
-	ERRCHECK(result);
+	result = system->getAdvancedSettings(&settings);
+	ERRCHECK(result);
+
+	settings.vol0virtualvol = volume;
+
+	result = system->setAdvancedSettings(&settings);
+	if (ERRCHECK(result))
+		vol0virtualvol = volume;
+}
+
+bool Bridge::check_voice_budget(const ChannelParams& params, const SoundEntry& source, const GroupEntry& group) {
+	const auto now = std::chrono::steady_clock::now();
+	if (params.cooldown > 0 && now - source.last_played < std::chrono::microseconds(params.cooldown))
+		return false;
+
+	// Looped sounds may become audible later, and FMOD virtualizes them until then.
+	// Others are estimated the same way FMOD does it (inverse rolloff), but without
+	// occlusion and other effects - so estimate is never lower than actual volume.
+	if (!params.looped) {
+		float volume = params.volume * total_group_volume(group);
+		if (params.is_positional) {
+			float distance = listener_distance(vector(params.position));
+			if (distance > params.min_distance) {
+				distance = (distance - params.min_distance) * rolloff_scale + params.min_distance;
+				distance = std::min(distance, params.max_distance);
+				if (distance > 0)
+					volume *= params.min_distance / distance;
+			}
+		}
+		if (volume < std::max(vol0virtualvol, group.virtual_volume))
+			return false;
+	}
+
+	if (group.max_instances > 0) {
+		int count = 0; // includes virtual channels
+		result = group.group->getNumChannels(&count);
+		ERRCHECK(result);
+		if (count >= group.max_instances)
+			return false;
+	}
+
+	return true;
+}
+
+bool Bridge::apply_channel_update(int id, FMOD::Channel* channel, const ChannelUpdateParams& params) {
+	bool is_playing = false;
+	result = channel->isPlaying(&is_playing);
+	
+	if (result == FMOD_ERR_INVALID_HANDLE || result == FMOD_ERR_CHANNEL_STOLEN)
+		return false; // sound stopped or stolen (reused, i.e. for higher priority sound)
+	if (!ERRCHECK(result))
+		return false;
+	
+	if (params.set_position) {
+		auto position = vector(params.position);
+		auto velocity = vector(params.velocity);
+
+		if (check_spatial_update(id, position, velocity)) {
+			result = channel->set3DAttributes(&position, &velocity);
+			ERRCHECK(result);
+		}
+	}
+
+	if (params.set_volume_etc) {
+		result = channel->setVolume(params.volume);
+		ERRCHECK(result);
+
+		result = channel->setPitch(params.pitch);
+		ERRCHECK(result);
+
+		result = channel->setPriority(params.priority);
+		ERRCHECK(result);
+	}
+
+	return is_playing;
+}
+
+bool Bridge::check_spatial_update(int id, FMOD_VECTOR position, FMOD_VECTOR velocity) {
+	const size_t i = channels.index_of(id);
+	if (i >= spatial_cache.x.size())
+		return true;
+
+	// emitters beyond max distance are updated less often; their panning and doppler don't
+	// change much. Channel index spreads these updates across frames
+	if (spatial_cache.is_far[i] && far_update_interval > 1 && (update_count + i) % far_update_interval)
+		return false;
+
+	const float dx = position.x - spatial_cache.x[i];
+	const float dy = position.y - spatial_cache.y[i];
+	const float dz = position.z - spatial_cache.z[i];
+	const float dvx = velocity.x - spatial_cache.velocity_x[i];
+	const float dvy = velocity.y - spatial_cache.velocity_y[i];
+	const float dvz = velocity.z - spatial_cache.velocity_z[i];
+	if (dx * dx + dy * dy + dz * dz <= spatial_epsilon_sq && dvx * dvx + dvy * dvy + dvz * dvz <= spatial_epsilon_sq)
+		return false;
+
+	spatial_cache.set(i, position, velocity);
+	return true;
+}
+
+void Bridge::update_far_channels() {
+	// plain loops over arrays, so compiler can vectorize them.
+	// Channel is far if it's far from all listeners
+	const size_t n = spatial_cache.x.size();
+	const float* x = spatial_cache.x.data();
+	const float* y = spatial_cache.y.data();
+	const float* z = spatial_cache.z.data();
+	const float* max_distance_sq = spatial_cache.max_distance_sq.data();
+	uint32_t* is_far = spatial_cache.is_far.data();
+
+	std::fill(is_far, is_far + n, 1);
+	for (int l = 0; l < listener_count; ++l) {
+		const float lx = listener_positions[l].x, ly = listener_positions[l].y, lz = listener_positions[l].z;
+		for (size_t i = 0; i < n; ++i) {
+			const float dx = x[i] - lx;
+			const float dy = y[i] - ly;
+			const float dz = z[i] - lz;
+			is_far[i] &= dx * dx + dy * dy + dz * dz > max_distance_sq[i];
+		}
+	}
+}
+
+std::unique_lock<std::recursive_mutex> Bridge::lock_state() {
+	if (use_update_thread)
+		return std::unique_lock<std::recursive_mutex>(state_mutex);
+	return {};
+}
+
+void Bridge::update() {
+	if (!use_update_thread)
+		update_system();
+}
+
+void Bridge::update_system() {
+	PROFILER_ZONE("Bridge::update_system");
+	ScopedTimer timer(method_counter(TimedMethod::Update));
+
+	apply_queued_listener_updates();
+
+	++update_count;
+	update_far_channels();
+
+	apply_queued_channel_updates();
+
+	{
+		PROFILER_ZONE("FMOD::System::update");
+		result = system->update();
+		ERRCHECK(result);
+	}
+}
+
+unsigned long long Bridge::render(uint32_t samples) {
+	PROFILER_ZONE("Bridge::render");
+	if (!is_nrt_output || use_update_thread) {
+		error_msg("Rendering requires non-realtime output and no update thread");
+		return 0;
+	}
+
+	FMOD::ChannelGroup* master = nullptr;
+	result = system->getMasterChannelGroup(&master);
+	if (!ERRCHECK(result))
+		return 0;
+
+	unsigned long long start = 0;
+	result = master->getDSPClock(&start, nullptr);
+	if (!ERRCHECK(result))
+		return 0;
+
+	unsigned long long clock = start;
+	while (clock - start < samples) {
+		update_system();
+
+		const auto previous = clock;
+		result = master->getDSPClock(&clock, nullptr);
+		if (!ERRCHECK(result) || clock == previous)
+			break; // mixer is stuck, don't loop forever
+	}
+	return clock - start;
+}
+
+void Bridge::update_engine(EngineParams params) {
+	PROFILER_ZONE("Bridge::update_engine");
+	auto lock = lock_state();
+	apply_queued_listener_updates(); // reverb slots below depend on it
+
+	result = system->set3DSettings(params.doppler_scale, params.distance_scale, params.rolloff_scale);
+	ERRCHECK(result);
+	rolloff_scale = params.rolloff_scale;
+
+	result = system->setGeometrySettings(params.max_world_size);
+	ERRCHECK(result);
+
+	if (params.virtual_volume != vol0virtualvol)
+		set_virtual_volume(params.virtual_volume);
+
+	// applied once, so it affects all groups, including ones created implicitly
+	FMOD::ChannelGroup* master = nullptr;
+	result = system->getMasterChannelGroup(&master);
+	if (ERRCHECK(result)) {
+		result = master->setVolume(params.master_volume);
+		if (ERRCHECK(result))
+			master_volume = params.master_volume;
+	}
+
+	spatial_epsilon_sq = params.spatial_epsilon * params.spatial_epsilon;
+	far_update_interval = std::max(params.far_update_interval, 1u);
+
+	max_active_reverbs = params.max_active_reverbs;
+	while (reverb_slots.size() > max_active_reverbs) {
+		auto& slot = reverb_slots.back();
+		if (auto entry = reverbs.get(slot.reverb_id))
+			entry->slot = -1;
+
+		result = slot.reverb->release();
+		ERRCHECK(result);
+
+		reverb_slots.pop_back();
+	}
+	update_reverb_slots();
+}
+	
+FrameClock Bridge::begin_frame_clock() {
+	PROFILER_ZONE("Bridge::begin_frame_clock");
+	auto lock = lock_state();
+
+	FMOD::ChannelGroup* master = nullptr;
+	result = system->getMasterChannelGroup(&master);
+	if (ERRCHECK(result)) {
+		result = master->getDSPClock(&frame_clock, nullptr);
+		ERRCHECK(result);
+	}
+
+	FrameClock clock;
+	clock.clock = frame_clock;
+	clock.sample_rate = sample_rate;
+	return clock;
+}
+
+BridgeStats Bridge::get_stats() {
+	PROFILER_ZONE("Bridge::get_stats");
+	auto lock = lock_state();
+
+	BridgeStats stats = {};
+
+	FMOD_CPU_USAGE cpu = {};
+	result = system->getCPUUsage(&cpu);
+	ERRCHECK(result);
+	stats.cpu_dsp = cpu.dsp;
+	stats.cpu_stream = cpu.stream;
+	stats.cpu_geometry = cpu.geometry;
+	stats.cpu_update = cpu.update;
+
+	int channels = 0, real_channels = 0;
+	result = system->getChannelsPlaying(&channels, &real_channels);
+	ERRCHECK(result);
+	stats.channels_playing = channels;
+	stats.channels_real = real_channels;
+
+	int memory_current = 0, memory_max = 0;
+	result = FMOD::Memory_GetStats(&memory_current, &memory_max, false);
+	ERRCHECK(result);
+	stats.memory_current = memory_current;
+	stats.memory_max = memory_max;
+
+	long long sample_bytes = 0, stream_bytes = 0, other_bytes = 0;
+	result = system->getFileUsage(&sample_bytes, &stream_bytes, &other_bytes);
+	ERRCHECK(result);
+	stats.sample_bytes_read = sample_bytes;
+	stats.stream_bytes_read = stream_bytes;
+	stats.other_bytes_read = other_bytes;
+
+	static const char* const method_names[] = {
+		"update",
+		"update_listener",
+		"load_audio_file",
+		"play_channel",
+		"update_channels",
+		"add_geometry",
+		"add_reverb",
+	};
+	static_assert(sizeof(method_names) / sizeof(method_names[0]) == size_t(TimedMethod::Count), "Name of each method must be specified");
+
+	stats.methods.reserve(size_t(TimedMethod::Count));
+	for (size_t i = 0; i < size_t(TimedMethod::Count); ++i) {
+		MethodStats method;
+		method.name = method_names[i];
+		method.calls = method_counters[i].calls;
+		method.total_ns = method_counters[i].total_ns;
+		stats.methods.push_back(method);
+	}
+
+	return stats;
+}
+
+static ListenerBatch listener_batch(rust::Slice<const ListenerParams> listeners) {
+	ListenerBatch batch;
+	if (listeners.size() > FMOD_MAX_LISTENERS)
+		error_msg("Too many listeners: %zu, only first %d are used", listeners.size(), FMOD_MAX_LISTENERS);
+
+	batch.count = std::min(listeners.size(), size_t(FMOD_MAX_LISTENERS));
+	for (int i = 0; i < batch.count; ++i) {
+		auto& params = listeners[i];
+		batch.listeners[i] = {vector(params.position), vector(params.velocity), vector(params.forward), vector(params.up)};
+	}
+	return batch;
+}
+
+void Bridge::set_listeners(const ListenerBatch& batch) {
+	ScopedTimer timer(method_counter(TimedMethod::UpdateListener));
+	if (!batch.count)
+		return;
+
+	if (batch.count != listener_count) {
+		result = system->set3DNumListeners(batch.count);
+		if (ERRCHECK(result))
+			listener_count = batch.count;
+	}
+
+	for (int i = 0; i < std::min(batch.count, listener_count); ++i) {
+		auto& listener = batch.listeners[i];
+		result = system->set3DListenerAttributes(i, &listener.position, &listener.velocity, &listener.forward, &listener.up);
+		ERRCHECK(result);
+		listener_positions[i] = listener.position;
+	}
+
+	geometries.for_each([this](int, GeometryEntry& entry) {
+		if (entry.proxy || entry.cull_distance > 0)
+			update_geometry_lod(entry);
+	});
+	update_reverb_slots();
+}
+
+void Bridge::apply_queued_listener_updates() {
+	ListenerBatch listeners;
+	if (listener_updates.pop(listeners))
+		set_listeners(listeners);
+}
+
+float Bridge::listener_distance(FMOD_VECTOR position) const {
+	float distance = INFINITY;
+	for (int i = 0; i < listener_count; ++i) {
+		const FMOD_VECTOR delta = {
+			listener_positions[i].x - position.x,
+			listener_positions[i].y - position.y,
+			listener_positions[i].z - position.z,
+		};
+		distance = std::min(distance, length(delta));
+	}
+	return distance;
+}
+
+void Bridge::update_listener(ListenerParams params) {
+	update_listeners({&params, 1});
+}
+
+void Bridge::update_listeners(rust::Slice<const ListenerParams> listeners) {
+	PROFILER_ZONE("Bridge::update_listeners");
+	auto lock = lock_state();
+	apply_queued_listener_updates(); // older, mustn't overwrite this one later
+	set_listeners(listener_batch(listeners));
+}
+
+void Bridge::queue_listener_update(ListenerParams params) const {
+	queue_listener_updates({&params, 1});
+}
+
+void Bridge::queue_listener_updates(rust::Slice<const ListenerParams> listeners) const {
+	PROFILER_ZONE("Bridge::queue_listener_updates");
+	listener_updates.push(listener_batch(listeners)); // replaces older one if it wasn't applied yet
+}
+
+void Bridge::update_group(GroupParams params) {
+	PROFILER_ZONE("Bridge::update_group");
+	auto lock = lock_state();
+
+	if (!check_group_id(params.user_id))
+		return;
+	if (params.parent_id != -1 && !check_group_id(params.parent_id))
+		return;
+
+	if (params.parent_id != -1) {
+		for (int i = params.parent_id; i != -1; i = size_t(i) < groups.size() ? groups[i].parent_id : -1) {
+			if (i == params.user_id) {
+				error_msg("Group %d can't be a child of group %d, it would create a cycle", params.user_id, params.parent_id);
+				return;
+			}
+		}
+		get_group(params.parent_id); // create parent first, it may resize the table
+	}
+
+	if (params.sidechain_group_id != -1 && params.compressor_ratio > 1) {
+		if (!check_group_id(params.sidechain_group_id))
+			return;
+		if (params.sidechain_group_id == params.user_id) {
+			error_msg("Group %d can't be its own sidechain", params.user_id);
+			return;
+		}
+		get_group(params.sidechain_group_id); // same as parent
+	}
+
+	if (size_t(params.user_id) >= groups.size())
+		groups.resize(params.user_id + 1);
+
+	auto& entry = groups[params.user_id];
+	auto& group = entry.group;
+
+	// create group if needed
+	if (!group) {
+		char group_name[16];
+		snprintf(group_name, sizeof(group_name), "%d", params.user_id);
+
+		result = system->createChannelGroup(group_name, &group);
+		if (!ERRCHECK(result))
+			return;
+
+		// TODO(later): is it possible to reduce ramp duration?
+		result = group->setVolumeRamp(true); // enable smooth change of volume
+		ERRCHECK(result);
+	}
+
+	if (params.parent_id != entry.parent_id) {
+		FMOD::ChannelGroup* parent = nullptr;
+		if (params.parent_id != -1)
+			parent = groups[params.parent_id].group;
+		else {
+			result = system->getMasterChannelGroup(&parent);
+			ERRCHECK(result);
+		}
+
+		if (parent) {
+			result = parent->addGroup(group); // also removes it from the old parent
+			if (ERRCHECK(result))
+				entry.parent_id = params.parent_id;
+		}
+	}
+
+	result = group->setVolume(params.volume);
+	ERRCHECK(result);
+
+	update_group_dsp(entry, params);
+
+	entry.volume = params.volume;
+	entry.max_instances = params.max_instances;
+	entry.virtual_volume = params.virtual_volume;
+}
+
+int Bridge::load_audio_file(AudioFileParams params) {
+	PROFILER_ZONE("Bridge::load_audio_file");
+	auto lock = lock_state();
+	ScopedTimer timer(method_counter(TimedMethod::LoadAudioFile));
+
+	int flags = FMOD_3D | FMOD_LOOP_NORMAL; // allow spatial usage and being looped
+	auto mode = params.mode;
+
+	FMOD_CREATESOUNDEXINFO exinfo = {};
+	exinfo.cbsize = sizeof(FMOD_CREATESOUNDEXINFO);
+	exinfo.filebuffersize = params.stream_buffer_size; // 0 is FMOD default
+
+	const char* name_or_data = nullptr;
+	bool keep_buffer = false;
+	bool non_blocking = params.non_blocking;
+	uint64_t hash = 0;
+	Sha256::Digest digest = {};
+
+	if (!params.filename.empty()) {
+		if (mode == LoadMode::Default)
+			mode = LoadMode::Stream; // don't load whole file into memory
+
+		name_or_data = params.filename.c_str();
+
+		if (params.use_file_callbacks) {
+			exinfo.fileuseropen = file_open_callback;
+			exinfo.fileuserclose = file_close_callback;
+			exinfo.fileuserasyncread = file_async_read_callback; // FMOD doesn't use read and seek callbacks then
+			exinfo.fileuserasynccancel = file_async_cancel_callback;
+		}
+	}
+	else {
+		rust::Slice<const uint8_t> data;
+
+		if (!params.file_buffer.empty()) {
+			if (mode == LoadMode::Default)
+				mode = LoadMode::Stream;
+
+			data = {params.file_buffer.data(), params.file_buffer.size()};
+			keep_buffer = mode != LoadMode::Sample; // decoded sample doesn't need the file anymore
+
+			if (non_blocking && mode == LoadMode::CompressedSample)
+				keep_buffer = false; // can't fall back to copying (see below) if loading fails later
+		}
+		else if (!params.file_contents.empty()) {
+			if (mode == LoadMode::Default)
+				mode = LoadMode::Sample;
+
+			data = params.file_contents;
+			non_blocking = false; // data is valid only during this call
+		}
+		else {
+			error_msg("No sound data");
+			return -1;
+		}
+
+		// streams can't be played back more than once at a time, so only samples are cached
+		if (mode != LoadMode::Stream) {
+			digest = content_digest(data.data(), data.size(), uint8_t(mode));
+			hash = cache_key(digest);
+
+			auto cached = sound_cache.find(hash);
+			if (cached != sound_cache.end()) {
+				const int cached_id = cached->second;
+				auto entry = sounds.get(cached_id);
+				const auto state = entry->loading ? open_state(entry->sound) : LoadState::Ready;
+
+				if (entry->digest != digest)
+					hash = 0; // different contents, sound is loaded without caching
+				else if (state == LoadState::Error) {
+					// loading failed, load again; existing users keep the failed sound
+					sound_cache.erase(cached);
+					entry->hash = 0;
+				}
+				else if (state == LoadState::Loading && !non_blocking)
+					hash = 0; // caller expects the sound to be ready
+				else {
+					++entry->refcount;
+					return cached_id;
+				}
+			}
+		}
+
+		// buffer will be used as is if it's kept, otherwise FMOD copies it
+		flags |= keep_buffer ? FMOD_OPENMEMORY_POINT : FMOD_OPENMEMORY;
+
+		exinfo.length = data.size();
+		name_or_data = reinterpret_cast<const char*>(data.data());
+	}
+
+	if (non_blocking) {
+		flags |= FMOD_NONBLOCKING; // loading happens in FMOD thread, see poll_load_state
+		exinfo.nonblockcallback = sound_loaded_callback;
+	}
+
+	switch (mode) {
+	case LoadMode::CompressedSample: flags |= FMOD_CREATECOMPRESSEDSAMPLE; break;
+	case LoadMode::Stream: flags |= FMOD_CREATESTREAM; break;
+	default: flags |= FMOD_CREATESAMPLE; break;
+	}
+
+	FMOD::Sound* sound = nullptr;
+	result = system->createSound(name_or_data, flags, &exinfo, &sound);
+
+	if (result == FMOD_ERR_MEMORY_CANTPOINT) {
+		// compressed samples can be used in place only for some formats, copy the data for others
+		flags = (flags & ~FMOD_OPENMEMORY_POINT) | FMOD_OPENMEMORY;
+		keep_buffer = false;
+
+		result = system->createSound(name_or_data, flags, &exinfo, &sound);
+	}
+	if (!ERRCHECK(result)) {
+		if (!params.filename.empty())
+			info_msg("Path to the file: \"%s\"", params.filename.c_str());
+		return -1;
+	}
+
+	SoundEntry entry;
+	entry.sound = sound;
+	entry.refcount = 1;
+	entry.hash = hash;
+	if (hash)
+		entry.digest = digest;
+	entry.loading = non_blocking;
+	entry.keep_buffer = keep_buffer;
+	if (keep_buffer || non_blocking)
+		entry.buffer = std::move(params.file_buffer); // must outlive the sound, or at least its loading
+
+	const int id = sounds.insert(std::move(entry));
+	if (id == -1) {
+		error_msg("Too many objects of type sound");
+		sound->release();
+		return -1;
+	}
+
+	if (hash)
+		sound_cache[hash] = id;
+	return id;
+}
+
+LoadState Bridge::poll_load_state(int i) {
+	PROFILER_ZONE("Bridge::poll_load_state");
+	auto lock = lock_state();
+
+	auto entry = find_object(sounds, i, "sound");
+	if (!entry)
+		return LoadState::Error;
+
+	return check_load_state(*entry);
+}
+
+LoadState Bridge::load_state(int i) const {
+	PROFILER_ZONE("Bridge::load_state");
+
+	auto entry = sounds.get(i);
+	if (!entry) {
+		error_msg("Invalid sound ID: %d", i);
+		return LoadState::Error;
+	}
+
+	return entry->loading ? open_state(entry->sound) : LoadState::Ready;
+}
+
+void Bridge::free_audio_file(int i) {
+	PROFILER_ZONE("Bridge::free_audio_file");
+	auto lock = lock_state();
+
+	auto entry = find_object(sounds, i, "sound");
+	if (!entry)
+		return;
 
-	// linear volume below which channel is considered to be completely silent
-	// TODO(later): unhardcode - this can be changed at any time
-	settings.vol0virtualvol = 0.01;
+	if (--entry->refcount > 0)
+		return; // still used by someone else
 
-	result = system->setAdvancedSettings(&settings);
+	result = entry->sound->release(); // must be released before the buffer
 	ERRCHECK(result);
 
-	return true;
+	if (entry->hash)
+		sound_cache.erase(entry->hash);
+	sounds.remove(i);
 }
 
-Bridge::~Bridge() {
-	for (auto& reverb : reverbs) {
-		if (reverb)
-			reverb->release();
-	}
+static SoundDefaults sound_defaults(const SoundTemplate& params) {
+	SoundDefaults defaults;
+	defaults.is_positional = params.is_positional;
+	defaults.looped = params.looped;
+	defaults.min_distance = params.min_distance;
+	defaults.max_distance = params.max_distance;
+	defaults.priority = params.priority;
+	return defaults;
+}
 
-	for (auto& geometry : geometries) {
-		if (geometry)
-			geometry->release();
-	}
+int Bridge::add_sound_template(int sound_id, SoundTemplate params) {
+	PROFILER_ZONE("Bridge::add_sound_template");
+	auto lock = lock_state();
 
-	for (auto& channel : channels) {
-		if (channel)
-			channel->stop();
-	}
+	auto entry = find_object(sounds, sound_id, "sound");
+	if (!entry)
+		return -1;
 
-	for (auto& sound : sounds) {
-		if (sound)
-			sound->release();
-	}
+	SoundTemplateEntry templ;
+	templ.sound_id = sound_id;
+	templ.defaults = sound_defaults(params);
 
-	for (auto& group : groups) {
-		group.second->release();
+	const int id = sound_templates.insert(templ);
+	if (id == -1) {
+		error_msg("Too many objects of type sound template");
+		return -1;
 	}
 
-	result = system->close();
-	ERRCHECK(result);
-	
-	result = system->release();
-	ERRCHECK(result);
-}
-
-FMOD::ChannelGroup* Bridge::get_group(int user_id) {
-	auto& group = groups[user_id];
-	if (!group) { // create group with default parameters if it doesn't exist
-		GroupParams params;
-		params.user_id = user_id;
-		params.volume = 1.;
-		update_group(params);
+	// Shared sound keeps defaults it already has, channels of other users set them.
+	// Otherwise the last template would overwrite defaults of all others.
+	if (++entry->template_count == 1) {
+		entry->template_id = id;
+		apply_sound_template(*entry);
 	}
-	return group;
-}
-	
-void Bridge::update() {
-	result = system->update();
-	ERRCHECK(result);
+	else
+		entry->template_id = -1;
+
+	return id;
 }
 
-void Bridge::update_engine(EngineParams params) {
-	result = system->set3DSettings(params.doppler_scale, params.distance_scale, params.rolloff_scale);
-	ERRCHECK(result);
+void Bridge::set_sound_template(int i, SoundTemplate params) {
+	PROFILER_ZONE("Bridge::set_sound_template");
+	auto lock = lock_state();
 
-	result = system->setGeometrySettings(params.max_world_size);
-	ERRCHECK(result);
-}
-	
-void Bridge::update_listener(ListenerParams params) {
-	auto position = vector(params.position);
-	auto velocity = vector(params.velocity);
-	auto forward = vector(params.forward);
-	auto up = vector(params.up);
+	auto templ = find_object(sound_templates, i, "sound template");
+	if (!templ)
+		return;
+	templ->defaults = sound_defaults(params);
 
-	result = system->set3DListenerAttributes(0, &position, &velocity, &forward, &up);
-	ERRCHECK(result);
+	auto entry = sounds.get(templ->sound_id);
+	if (entry && entry->template_id == i)
+		apply_sound_template(*entry);
 }
 
-void Bridge::update_group(GroupParams params) {
-	auto& group = groups[params.user_id];
-
-	// create group if needed
-	if (!group) {
-		const auto group_name = std::to_string(params.user_id);
+void Bridge::free_sound_template(int i) {
+	PROFILER_ZONE("Bridge::free_sound_template");
+	auto lock = lock_state();
 
-		result = system->createChannelGroup(group_name.c_str(), &group);
-		if (!ERRCHECK(result))
-			return;
+	auto templ = find_object(sound_templates, i, "sound template");
+	if (!templ)
+		return;
 
-		// TODO(later): is it possible to reduce ramp duration?
-		result = group->setVolumeRamp(true); // enable smooth change of volume
-		ERRCHECK(result);
+	if (auto entry = sounds.get(templ->sound_id)) {
+		--entry->template_count;
+		if (entry->template_id == i)
+			entry->template_id = -1; // sound keeps its defaults
 	}
+	sound_templates.remove(i);
+}
 
-	result = group->setVolume(params.volume);
-	ERRCHECK(result);
+int Bridge::play_channel(ChannelParams params) {
+	PROFILER_ZONE("Bridge::play_channel");
+	auto lock = lock_state();
+	apply_queued_listener_updates(); // voice budget uses distance to the listener
+	ScopedTimer timer(method_counter(TimedMethod::PlayChannel));
+
+	return start_channel(params, get_group(params.group_id));
 }
 
-int Bridge::load_audio_file(AudioFileParams params) {
-	int flags = FMOD_3D | FMOD_LOOP_NORMAL; // allow spatial usage and being looped
-	FMOD::Sound* sound = nullptr;
+rust::Vec<int> Bridge::play_channels_batch(rust::Slice<const ChannelParams> entries) {
+	PROFILER_ZONE("Bridge::play_channels_batch");
+	auto lock = lock_state();
+	apply_queued_listener_updates();
+	ScopedTimer timer(method_counter(TimedMethod::PlayChannel));
 
-	if (!params.filename.empty()) {
-		flags |= FMOD_CREATESTREAM; // don't load whole file into memory
+	rust::Vec<int> ids;
+	ids.reserve(entries.size());
+	channels.reserve(entries.size());
 
-		result = system->createSound(params.filename.c_str(), flags, nullptr, &sound);
-		if (!ERRCHECK(result)) {
-			info_msg("Path to the file: \"%s\"", params.filename.c_str());
-			return -1;
+	// batches are usually for one or few groups, so only the last one is cached
+	GroupEntry* group = nullptr;
+	int group_id = 0;
+
+	for (auto& params : entries) {
+		if (!group || params.group_id != group_id) {
+			group = &get_group(params.group_id);
+			group_id = params.group_id;
 		}
+		ids.push_back(start_channel(params, *group));
 	}
-	else if (!params.file_contents.empty()) {
-		flags |= FMOD_OPENMEMORY;
+	return ids;
+}
 
-		FMOD_CREATESOUNDEXINFO exinfo = {};
-		exinfo.cbsize = sizeof(FMOD_CREATESOUNDEXINFO);
-    	exinfo.length = params.file_contents.size();
+int Bridge::start_channel(const ChannelParams& params, GroupEntry& group) {
+	auto source = find_object(sounds, params.file_id, "sound");
+	if (!source)
+		return -1;
 
-		result = system->createSound((const char*) params.file_contents.data(), flags, &exinfo, &sound);
-		if (!ERRCHECK(result))
-			return -1;
-	}
-	else {
-		error_msg("No sound data");
+	if (check_load_state(*source) != LoadState::Ready) {
+		error_msg("Sound %d is not loaded yet", params.file_id);
 		return -1;
 	}
-	
-	return sparse_array_insert(sounds, sound);
-}
-
-void Bridge::free_audio_file(int i) {
-	auto& sound = sounds.at(i);
-
-	result = sound->release();
-	ERRCHECK(result);
-
-	sound = nullptr;
-}
 
-int Bridge::play_channel(ChannelParams params) {
-	auto& source = sounds.at(params.file_id);
+	if (!check_voice_budget(params, *source, group))
+		return -3;
 
 	FMOD::Channel* channel = nullptr;
-	result = system->playSound(source, get_group(params.group_id), true, &channel); // sound starts paused
+	result = system->playSound(source->sound, group.group, true, &channel); // sound starts paused
 	if (!ERRCHECK(result))
 		return -1;
 
-	// set all parameters (before unpausing the sound)
+	const int id = channels.insert(channel);
+	if (id == -1) {
+		error_msg("Too many objects of type channel");
+		channel->stop();
+		return -1;
+	}
 
-	if (params.is_positional) {
-		result = channel->setMode(FMOD_3D);
-		ERRCHECK(result);
+	source->last_played = std::chrono::steady_clock::now(); // cooldown starts only if sound is played
 
-		auto position = vector(params.position);
-		auto velocity = vector(params.velocity);
+	// detect when sound stops, see collect_finished_channels
 
-		result = channel->set3DAttributes(&position, &velocity);
-		ERRCHECK(result);
+	result = channel->setUserData(reinterpret_cast<void*>(intptr_t(id)));
+	ERRCHECK(result);
 
-		result = channel->set3DMinMaxDistance(params.min_distance, params.max_distance);
-		ERRCHECK(result);
-	}
-	else {
-		result = channel->setMode(FMOD_2D);
+	result = channel->setCallback(channel_callback);
+	ERRCHECK(result);
+
+	// set parameters which differ from sound defaults (before unpausing the sound)
+
+	if (params.is_positional != source->defaults.is_positional) {
+		result = channel->setMode(params.is_positional ? FMOD_3D : FMOD_2D);
 		ERRCHECK(result);
 	}
 
-	if (params.startup_delay) {
-		// Delay is set used global clock (or clock of parent DSP).
-		// We need to get current clock value and convert delay into clock ticks.
-
-		unsigned long long parentclock = 0; // delay uses parent clock, not channel one
-		int ticks_per_second = 0; // sample rate = clock ticks per second
+	const auto position = vector(params.position);
+	const auto velocity = vector(params.velocity);
 
-		result = channel->getDSPClock(nullptr, &parentclock);
+	if (params.is_positional) {
+		result = channel->set3DAttributes(&position, &velocity);
 		ERRCHECK(result);
 
-		result = system->getSoftwareFormat(&ticks_per_second, nullptr, nullptr);
-		ERRCHECK(result);
+		if (params.min_distance != source->defaults.min_distance || params.max_distance != source->defaults.max_distance) {
+			result = channel->set3DMinMaxDistance(params.min_distance, params.max_distance);
+			ERRCHECK(result);
+		}
+	}
 
+	const size_t index = channels.index_of(id);
+	if (index >= spatial_cache.x.size())
+		spatial_cache.resize(std::max(index + 1, spatial_cache.x.size() * 2));
+	spatial_cache.set(index, position, velocity);
+	spatial_cache.max_distance_sq[index] = params.is_positional ? params.max_distance * params.max_distance : INFINITY;
+	spatial_cache.is_far[index] = false; // until the next update
+
+	// Delay uses clock of parent DSP, which ticks together with the master one.
+	// Clock is in samples, i.e. sample rate is clock ticks per second.
+	unsigned long long start_clock = params.start_clock;
+	if (!start_clock && params.startup_delay > 0) {
 		const auto microseconds_per_second = 1000. * 1000.;
-		const auto delay = ticks_per_second * (params.startup_delay / microseconds_per_second);
-		
-		result = channel->setDelay(parentclock + delay, 0);
-		ERRCHECK(result);
+		start_clock = frame_clock + static_cast<unsigned long long>(sample_rate * (params.startup_delay / microseconds_per_second));
 	}
-	else {
-		result = channel->setDelay(0, 0); // in case channel got re-used // TODO(later): is this needed?
+
+	if (start_clock) { // playSound resets delay of re-used channel
+		result = channel->setDelay(start_clock, 0);
 		ERRCHECK(result);
 	}
 
-	result = channel->setLoopCount(params.looped ? -1 : 0); // -1 for infinite repeat
-	ERRCHECK(result);
+	if (params.looped != source->defaults.looped) {
+		result = channel->setLoopCount(params.looped ? -1 : 0); // -1 for infinite repeat
+		ERRCHECK(result);
+	}
 
-	result = channel->setVolume(params.volume);
-	ERRCHECK(result);
+	if (params.volume != 1) {
+		result = channel->setVolume(params.volume);
+		ERRCHECK(result);
+	}
 
-	result = channel->setPitch(params.pitch);
-	ERRCHECK(result);
+	if (params.pitch != 1) {
+		result = channel->setPitch(params.pitch);
+		ERRCHECK(result);
+	}
 
-	result = channel->setPriority(params.priority);
-	ERRCHECK(result);
+	if (params.priority != source->defaults.priority) {
+		result = channel->setPriority(params.priority);
+		ERRCHECK(result);
+	}
 
 	// all parameters are set, start playback
 
 	result = channel->setPaused(false);
 	ERRCHECK(result);
 
-	return sparse_array_insert(channels, channel);
+	return id;
+}
+
+void Bridge::apply_queued_channel_updates() {
+	ChannelBatchEntry entry;
+	while (channel_updates.pop(entry)) {
+		auto channel = channels.get(entry.id);
+		if (channel) // channel could've been freed after update was queued
+			apply_channel_update(entry.id, *channel, entry.params);
+	}
 }
 
 bool Bridge::update_channel(int i, ChannelUpdateParams params) {
-	auto& channel = channels.at(i);
+	PROFILER_ZONE("Bridge::update_channel");
+	auto lock = lock_state();
+	ScopedTimer timer(method_counter(TimedMethod::UpdateChannels));
 
-	bool is_playing = false;
-	result = channel->isPlaying(&is_playing);
-	
-	if (result == FMOD_ERR_INVALID_HANDLE || result == FMOD_ERR_CHANNEL_STOLEN)
-		return false; // sound stopped or stolen (reused, i.e. for higher priority sound)
-	if (!ERRCHECK(result))
+	auto channel = find_object(channels, i, "channel");
+	if (!channel)
 		return false;
-	
-	if (params.set_position) {
-		auto position = vector(params.position);
-		auto velocity = vector(params.velocity);
 
-		result = channel->set3DAttributes(&position, &velocity);
-		ERRCHECK(result);
-	}
+	return apply_channel_update(i, *channel, params);
+}
 
-	if (params.set_volume_etc) {
-		result = channel->setVolume(params.volume);
-		ERRCHECK(result);
+rust::Vec<uint64_t> Bridge::update_channels_batch(rust::Slice<const ChannelBatchEntry> entries) {
+	PROFILER_ZONE("Bridge::update_channels_batch");
+	auto lock = lock_state();
+	ScopedTimer timer(method_counter(TimedMethod::UpdateChannels));
 
-		result = channel->setPitch(params.pitch);
-		ERRCHECK(result);
+	apply_queued_channel_updates();
 
-		result = channel->setPriority(params.priority);
-		ERRCHECK(result);
+	rust::Vec<uint64_t> is_playing;
+	is_playing.reserve((entries.size() + 63) / 64);
+
+	uint64_t bits = 0;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		auto& entry = entries[i];
+		auto channel = find_object(channels, entry.id, "channel");
+		if (channel && apply_channel_update(entry.id, *channel, entry.params))
+			bits |= uint64_t(1) << (i % 64);
+
+		if (i % 64 == 63) {
+			is_playing.push_back(bits);
+			bits = 0;
+		}
 	}
+	if (entries.size() % 64)
+		is_playing.push_back(bits);
 
 	return is_playing;
 }
 
+size_t Bridge::queue_channel_updates(rust::Slice<const ChannelBatchEntry> entries) const {
+	PROFILER_ZONE("Bridge::queue_channel_updates");
+	size_t i = 0;
+	for (; i < entries.size(); ++i) {
+		if (!channel_updates.push(entries[i]))
+			break;
+	}
+	return i;
+}
+
 bool Bridge::is_playing_channel(int i) {
-	auto& channel = channels.at(i);
+	PROFILER_ZONE("Bridge::is_playing_channel");
+	auto lock = lock_state();
+
+	auto channel = find_object(channels, i, "channel");
+	if (!channel)
+		return false;
 
 	bool is_playing = false;
-	result = channel->isPlaying(&is_playing);
+	result = (*channel)->isPlaying(&is_playing);
 	
 	if (result != FMOD_ERR_INVALID_HANDLE && result != FMOD_ERR_CHANNEL_STOLEN) {
 		if (!ERRCHECK(result)) // sound stopped or stolen
@@ -368,58 +1860,216 @@ bool Bridge::is_playing_channel(int i) {
 	return is_playing;
 }
 
+rust::Vec<int> Bridge::collect_finished_channels() {
+	PROFILER_ZONE("Bridge::collect_finished_channels");
+	auto lock = lock_state();
+
+	rust::Vec<int> finished;
+	finished.reserve(finished_channels.size());
+
+	for (int id : finished_channels) {
+		if (channels.remove(id)) // skip channels already freed with free_channel
+			finished.push_back(id);
+	}
+	finished_channels.clear();
+
+	return finished;
+}
+
 void Bridge::free_channel(int i) {
-	auto& channel = channels.at(i);
+	PROFILER_ZONE("Bridge::free_channel");
+	auto lock = lock_state();
+
+	auto channel = find_object(channels, i, "channel");
+	if (!channel)
+		return;
 
-	result = channel->stop();
+	(*channel)->setCallback(nullptr); // slot is freed right now, no need to report it
+
+	result = (*channel)->stop();
 	
 	if (result != FMOD_ERR_INVALID_HANDLE && result != FMOD_ERR_CHANNEL_STOLEN)
 		ERRCHECK(result); // sound stopped or stolen
 
-	channel = nullptr;
+	channels.remove(i);
 }
 
 int Bridge::add_geometry(Geometry params) {
-	int vertex_count = 0;
-	for (auto& polygon : params.polygons)
-		vertex_count += polygon.vertices.size();
+	PROFILER_ZONE("Bridge::add_geometry");
+	auto lock = lock_state();
+	ScopedTimer timer(method_counter(TimedMethod::AddGeometry));
 
-	// info_msg("Adding geometry: %d polygons, %d vertices", int(params.polygons.size()), vertex_count);
+	auto geometry = create_geometry(params);
+	if (!geometry)
+		return -1;
 
-	FMOD::Geometry* geometry = nullptr;
-	result = system->createGeometry(params.polygons.size(), vertex_count, &geometry);
-	if (!ERRCHECK(result))
+	return insert_geometry(geometry);
+}
+
+int Bridge::add_geometry_flat(FlatGeometry params) {
+	PROFILER_ZONE("Bridge::add_geometry_flat");
+	auto lock = lock_state();
+	ScopedTimer timer(method_counter(TimedMethod::AddGeometry));
+
+	auto geometry = create_geometry(params);
+	if (!geometry)
 		return -1;
 
-	for (auto& polygon : params.polygons) {
-		std::vector<FMOD_VECTOR> vertices;
-		vertices.reserve(polygon.vertices.size());
-		for (auto& vertex : polygon.vertices)
-			vertices.push_back(vector(vertex));
+	return insert_geometry(geometry);
+}
 
-		int polygon_index = 0; // unused value
-		result = geometry->addPolygon(params.direct_occlusion, params.reverb_occlusion, true, vertices.size(), vertices.data(), &polygon_index);
+void Bridge::free_geometry(int i) {
+	PROFILER_ZONE("Bridge::free_geometry");
+	auto lock = lock_state();
+
+	auto entry = find_object(geometries, i, "geometry");
+	if (!entry)
+		return;
+
+	result = entry->geometry->release();
+	ERRCHECK(result);
+
+	if (entry->proxy) {
+		result = entry->proxy->release();
 		ERRCHECK(result);
 	}
 
-	return sparse_array_insert(geometries, geometry);
+	geometries.remove(i);
 }
 
-void Bridge::free_geometry(int i) {
-	auto& geometry = geometries.at(i);
+void Bridge::update_geometry_transform(int i, GeometryTransform transform) {
+	PROFILER_ZONE("Bridge::update_geometry_transform");
+	auto lock = lock_state();
+	apply_queued_listener_updates(); // level of detail depends on it
+
+	auto entry = find_object(geometries, i, "geometry");
+	if (!entry)
+		return;
+
+	set_geometry_transform(*entry, transform);
+	if (entry->proxy || entry->cull_distance > 0)
+		update_geometry_lod(*entry);
+}
+
+int Bridge::add_geometry_prototype(FlatGeometry params) {
+	PROFILER_ZONE("Bridge::add_geometry_prototype");
+	auto lock = lock_state();
+
+	auto data = save_geometry(params);
+	if (data.empty())
+		return -1;
+
+	const int id = geometry_prototypes.insert(std::move(data));
+	if (id == -1)
+		error_msg("Too many objects of type geometry prototype");
+	return id;
+}
+
+rust::Vec<uint8_t> Bridge::bake_geometry(FlatGeometry params) {
+	PROFILER_ZONE("Bridge::bake_geometry");
+	auto lock = lock_state();
+
+	auto data = save_geometry(params);
+
+	rust::Vec<uint8_t> baked;
+	baked.reserve(data.size());
+	for (char c : data)
+		baked.push_back(c);
+	return baked;
+}
+
+int Bridge::load_geometry_prototype(rust::Slice<const uint8_t> data) {
+	PROFILER_ZONE("Bridge::load_geometry_prototype");
+	auto lock = lock_state();
+
+	// check data now, so errors are reported on load and not on each instance
+	FMOD::Geometry* geometry = nullptr;
+	result = system->loadGeometry(data.data(), data.size(), &geometry);
+	if (!ERRCHECK(result))
+		return -1;
 
 	result = geometry->release();
 	ERRCHECK(result);
 
-	geometry = nullptr;
+	const int id = geometry_prototypes.insert(std::vector<char>(data.begin(), data.end()));
+	if (id == -1)
+		error_msg("Too many objects of type geometry prototype");
+	return id;
 }
 
-int Bridge::add_reverb(Reverb params) {
-	FMOD::Reverb3D* reverb = nullptr;
-	result = system->createReverb3D(&reverb);
-	if (!ERRCHECK(result))
+void Bridge::free_geometry_prototype(int i) {
+	PROFILER_ZONE("Bridge::free_geometry_prototype");
+	auto lock = lock_state();
+
+	if (!find_object(geometry_prototypes, i, "geometry prototype"))
+		return;
+
+	geometry_prototypes.remove(i);
+}
+
+int Bridge::add_geometry_instance(int prototype_id, GeometryTransform transform) {
+	PROFILER_ZONE("Bridge::add_geometry_instance");
+	auto lock = lock_state();
+	ScopedTimer timer(method_counter(TimedMethod::AddGeometry));
+
+	auto data = find_object(geometry_prototypes, prototype_id, "geometry prototype");
+	if (!data)
 		return -1;
-	
+
+	auto geometry = load_geometry(*data);
+	if (!geometry)
+		return -1;
+
+	const int id = insert_geometry(geometry);
+	if (id != -1)
+		set_geometry_transform(*geometries.get(id), transform);
+	return id;
+}
+
+void Bridge::set_geometry_lod(int i, GeometryLod params) {
+	PROFILER_ZONE("Bridge::set_geometry_lod");
+	auto lock = lock_state();
+	apply_queued_listener_updates();
+
+	auto entry = find_object(geometries, i, "geometry");
+	if (!entry)
+		return;
+
+	if (entry->proxy) {
+		result = entry->proxy->release();
+		ERRCHECK(result);
+		entry->proxy = nullptr;
+	}
+
+	if (params.proxy_prototype_id != -1) {
+		auto data = find_object(geometry_prototypes, params.proxy_prototype_id, "geometry prototype");
+		if (data)
+			entry->proxy = load_geometry(*data);
+	}
+
+	entry->proxy_distance = entry->proxy ? params.proxy_distance : 0;
+	entry->cull_distance = params.cull_distance;
+
+	if (entry->proxy) {
+		// apply the same transform
+		result = entry->proxy->setPosition(&entry->position);
+		ERRCHECK(result);
+		result = entry->proxy->setRotation(&entry->forward, &entry->up);
+		ERRCHECK(result);
+		result = entry->proxy->setScale(&entry->scale);
+		ERRCHECK(result);
+	}
+
+	entry->lod = -1; // force update
+	update_geometry_lod(*entry);
+}
+
+int Bridge::add_reverb(Reverb params) {
+	PROFILER_ZONE("Bridge::add_reverb");
+	auto lock = lock_state();
+	apply_queued_listener_updates(); // slots are chosen by distance to the listener
+	ScopedTimer timer(method_counter(TimedMethod::AddReverb));
+
 	FMOD_REVERB_PROPERTIES prop = FMOD_PRESET_GENERIC;
 	prop.DecayTime = params.decay_time;
 	prop.EarlyDelay = params.early_delay;
@@ -434,23 +2084,138 @@ int Bridge::add_reverb(Reverb params) {
 	prop.EarlyLateMix = params.early_late_mix;
 	prop.WetLevel = params.wet_level;
 
-	result = reverb->setProperties(&prop);
-	ERRCHECK(result);
+	// there are usually only a few distinct presets, linear search is fine
+	int preset = -1;
+	reverb_presets.for_each([&](int id, ReverbPreset& existing) {
+		if (preset == -1 && !memcmp(&existing.props, &prop, sizeof(prop)))
+			preset = id;
+	});
+	if (preset == -1) {
+		preset = reverb_presets.insert({prop, 0});
+		if (preset == -1) {
+			error_msg("Too many objects of type reverb preset");
+			return -1;
+		}
+	}
 
-	FMOD_VECTOR position = vector(params.position);
-	result = reverb->set3DAttributes(&position, params.min_dist, params.max_dist);
-	ERRCHECK(result);
+	ReverbEntry entry;
+	entry.position = vector(params.position);
+	entry.min_dist = params.min_dist;
+	entry.max_dist = params.max_dist;
+	entry.preset = preset;
+
+	const int id = reverbs.insert(entry);
+	if (id == -1) {
+		error_msg("Too many objects of type reverb");
+		if (!reverb_presets.get(preset)->refcount)
+			reverb_presets.remove(preset);
+		return -1;
+	}
+	++reverb_presets.get(preset)->refcount;
 
-	return sparse_array_insert(reverbs, reverb);
+	update_reverb_slots();
+	return id;
 }
 
 void Bridge::free_reverb(int i) {
-	auto& reverb = reverbs.at(i);
+	PROFILER_ZONE("Bridge::free_reverb");
+	auto lock = lock_state();
+	apply_queued_listener_updates();
 
-	result = reverb->release();
-	ERRCHECK(result);
+	auto entry = find_object(reverbs, i, "reverb");
+	if (!entry)
+		return;
+
+	release_reverb_slot(*entry);
+
+	auto preset = reverb_presets.get(entry->preset);
+	if (!--preset->refcount)
+		reverb_presets.remove(entry->preset);
+
+	reverbs.remove(i);
+	update_reverb_slots(); // other sphere may take the slot
+}
+
+void Bridge::update_reverb_slots() {
+	// spheres which contain the listener, ordered by how much they affect it
+	reverb_candidates.clear();
+	reverbs.for_each([this](int id, ReverbEntry& entry) {
+		const float distance = listener_distance(entry.position);
+		if (distance >= entry.max_dist)
+			return; // no effect at all
+
+		// same falloff FMOD uses to blend reverbs
+		float weight = 1;
+		if (distance > entry.min_dist)
+			weight = (entry.max_dist - distance) / (entry.max_dist - entry.min_dist);
+
+		reverb_candidates.push_back({-weight, id});
+	});
+
+	if (reverb_candidates.size() > max_active_reverbs) {
+		std::nth_element(reverb_candidates.begin(), reverb_candidates.begin() + max_active_reverbs, reverb_candidates.end());
+		reverb_candidates.resize(max_active_reverbs);
+	}
+
+	// free slots of spheres which are no longer selected
+	for (auto& slot : reverb_slots) {
+		if (slot.reverb_id == -1)
+			continue;
+
+		bool selected = false;
+		for (auto& candidate : reverb_candidates)
+			selected |= candidate.second == slot.reverb_id;
 
-	reverb = nullptr;
+		if (!selected)
+			release_reverb_slot(*reverbs.get(slot.reverb_id));
+	}
+
+	// assign slots to newly selected spheres
+	for (auto& candidate : reverb_candidates) {
+		auto& entry = *reverbs.get(candidate.second);
+		if (entry.slot != -1)
+			continue;
+
+		size_t i = 0;
+		while (i < reverb_slots.size() && reverb_slots[i].reverb_id != -1)
+			++i;
+
+		if (i == reverb_slots.size()) {
+			ReverbSlot slot;
+			result = system->createReverb3D(&slot.reverb);
+			if (!ERRCHECK(result))
+				break;
+			reverb_slots.push_back(slot);
+		}
+
+		auto& slot = reverb_slots[i];
+		slot.reverb_id = candidate.second;
+		entry.slot = i;
+
+		if (slot.preset != entry.preset) {
+			slot.preset = entry.preset;
+			result = slot.reverb->setProperties(&reverb_presets.get(entry.preset)->props);
+			ERRCHECK(result);
+		}
+
+		result = slot.reverb->set3DAttributes(&entry.position, entry.min_dist, entry.max_dist);
+		ERRCHECK(result);
+
+		result = slot.reverb->setActive(true);
+		ERRCHECK(result);
+	}
+}
+
+void Bridge::release_reverb_slot(ReverbEntry& entry) {
+	if (entry.slot == -1)
+		return;
+
+	auto& slot = reverb_slots[entry.slot];
+	slot.reverb_id = -1;
+	entry.slot = -1;
+
+	result = slot.reverb->setActive(false);
+	ERRCHECK(result);
 }
 
 std::unique_ptr<Bridge> create(InitParams params) {
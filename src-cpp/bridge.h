@@ -1,11 +1,20 @@
 #ifndef BRIDGE_H
 #define BRIDGE_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include "../fmod/include/fmod.hpp"
+#include "rust/cxx.h"
+#include "command_queue.h"
+#include "sha256.h"
+#include "slot_map.h"
 
 // Forward declarations for structs generated by cxx-bridge.
 // See bridge.rs for description
@@ -15,9 +24,169 @@ struct GroupParams;
 struct AudioFileParams;
 struct ChannelParams;
 struct ChannelUpdateParams;
+struct ChannelBatchEntry;
 struct ListenerParams;
 struct Geometry;
+struct FlatGeometry;
+struct GeometryTransform;
+struct GeometryLod;
+struct BridgeStats;
+struct FrameClock;
+struct SoundTemplate;
 struct Reverb;
+enum class LoadState : uint8_t;
+
+// Parameters with which channels of a sound start. Initial values are FMOD defaults
+struct SoundDefaults {
+	bool is_positional = true;
+	bool looped = true;
+	float min_distance = 1, max_distance = 10000;
+	int priority = 128;
+};
+
+// Loaded sound
+struct SoundEntry {
+	FMOD::Sound* sound = nullptr;
+	int refcount = 0; // number of load_audio_file calls which returned this entry
+	uint64_t hash = 0; // key in sound cache; 0 if not cached
+	Sha256::Digest digest = {}; // of file contents and load mode, compared on cache hit (only if cached)
+	rust::Vec<uint8_t> buffer; // file contents used by the sound, if it's streamed from memory
+	bool keep_buffer = false; // if false, buffer is needed only until sound is loaded
+	bool loading = false; // created with FMOD_NONBLOCKING and not ready yet
+	std::chrono::steady_clock::time_point last_played; // see ChannelParams::cooldown
+
+	SoundDefaults defaults; // set on FMOD::Sound, see add_sound_template
+	int template_count = 0; // number of templates of this sound
+	int template_id = -1; // template which is applied to the sound, or -1 if none
+};
+
+// Channel defaults wanted by one user of a sound, see add_sound_template
+struct SoundTemplateEntry {
+	int sound_id = -1;
+	SoundDefaults defaults;
+};
+
+struct GroupEntry {
+	FMOD::ChannelGroup* group = nullptr;
+	float volume = 1;
+	int max_instances = 0; // 0 if unlimited
+	float virtual_volume = 0; // non-looped sounds quieter than this are not played
+	int parent_id = -1; // -1 if group is a child of the master group
+
+	// Effects, null if disabled. See GroupParams
+	FMOD::DSP* lowpass = nullptr;
+	FMOD::DSP* compressor = nullptr;
+	int sidechain_id = -1; // group which drives the compressor, or -1 if it's driven by own signal
+	FMOD::DSP* sidechain_input = nullptr; // head DSP of that group
+};
+
+// Last 3D attributes sent to channels, indexed by slot index of channel ID.
+// Kept as separate arrays, so the distance check over all channels is vectorized.
+struct ChannelSpatialCache {
+	std::vector<float> x, y, z;
+	std::vector<float> velocity_x, velocity_y, velocity_z;
+	std::vector<float> max_distance_sq; // infinity for non-positional channels
+	std::vector<uint32_t> is_far; // beyond max distance from the listener, updated in update_system
+
+	void resize(size_t n) {
+		for (auto v : {&x, &y, &z, &velocity_x, &velocity_y, &velocity_z, &max_distance_sq})
+			v->resize(n);
+		is_far.resize(n);
+	}
+
+	void set(size_t i, FMOD_VECTOR position, FMOD_VECTOR velocity) {
+		x[i] = position.x;
+		y[i] = position.y;
+		z[i] = position.z;
+		velocity_x[i] = velocity.x;
+		velocity_y[i] = velocity.y;
+		velocity_z[i] = velocity.z;
+	}
+};
+
+struct GeometryEntry {
+	FMOD::Geometry* geometry = nullptr;
+	FMOD::Geometry* proxy = nullptr; // simplified geometry used at distance, optional
+
+	// Transform, same for both geometries
+	FMOD_VECTOR position = {0, 0, 0};
+	FMOD_VECTOR forward = {0, 0, 1};
+	FMOD_VECTOR up = {0, 1, 0};
+	FMOD_VECTOR scale = {1, 1, 1};
+
+	// Bounding sphere of the geometry, in local space
+	FMOD_VECTOR local_center = {};
+	float local_radius = 0;
+
+	// Level of detail settings, disabled if zero
+	float proxy_distance = 0;
+	float cull_distance = 0;
+
+	int lod = 0; // 0 - full geometry is active, 1 - proxy is active, 2 - nothing is active
+};
+
+// Reverb sphere. It's applied only while it has a slot assigned.
+struct ReverbEntry {
+	FMOD_VECTOR position = {};
+	float min_dist = 0;
+	float max_dist = 0;
+	int preset = -1; // ID in reverb_presets
+	int slot = -1; // index in reverb_slots or -1
+};
+
+// Properties shared by all reverb spheres with the same values
+struct ReverbPreset {
+	FMOD_REVERB_PROPERTIES props;
+	int refcount = 0;
+};
+
+// FMOD reverb object which is used by one of reverb spheres at a time
+struct ReverbSlot {
+	FMOD::Reverb3D* reverb = nullptr;
+	int reverb_id = -1; // ID of the sphere or -1 if slot is free
+	int preset = -1; // ID of properties currently set, to avoid resetting them
+};
+
+// State of all listeners, set at once (see update_listeners)
+struct ListenerBatch {
+	FMOD_3D_ATTRIBUTES listeners[FMOD_MAX_LISTENERS];
+	int count = 0;
+};
+
+// Bridge methods for which call statistics are collected, see get_stats
+enum class TimedMethod {
+	Update,
+	UpdateListener,
+	LoadAudioFile,
+	PlayChannel,
+	UpdateChannels,
+	AddGeometry,
+	AddReverb,
+	Count
+};
+
+struct MethodCounter {
+	uint64_t calls = 0;
+	uint64_t total_ns = 0;
+};
+
+// Adds call and its duration to the counter when leaving the scope
+struct ScopedTimer {
+	MethodCounter& counter;
+	std::chrono::steady_clock::time_point start;
+
+	explicit ScopedTimer(MethodCounter& counter)
+		: counter(counter), start(std::chrono::steady_clock::now()) {}
+
+	~ScopedTimer() {
+		const auto duration = std::chrono::steady_clock::now() - start;
+		++counter.calls;
+		counter.total_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+	}
+
+	ScopedTimer(const ScopedTimer&) = delete;
+	ScopedTimer& operator=(const ScopedTimer&) = delete;
+};
 
 // Interface - FMOD wrapper.
 // Visible by Rust.
@@ -25,49 +194,240 @@ struct Bridge {
 	FMOD::System* system = {};
 	FMOD_RESULT result;
 
-	std::unordered_map<int, FMOD::ChannelGroup*> groups;
+	// Indexed by user ID. Group IDs are small, so table is dense
+	static constexpr int max_groups = 4096;
+	std::vector<GroupEntry> groups;
+
+	// Slot map IDs are used as IDs of objects (called EngineId in Rust plugin).
+	// See slot_map.h for details.
+
+	SlotMap<SoundEntry> sounds;
+	SlotMap<SoundTemplateEntry> sound_templates;
+	SlotMap<FMOD::Channel*> channels;
+	SlotMap<GeometryEntry> geometries;
+	SlotMap<ReverbEntry> reverbs;
+
+	// Saved geometry (see FMOD::Geometry::save), used to create instances
+	SlotMap<std::vector<char>> geometry_prototypes;
+
+	// Positions of the listeners. Geometry level of detail, reverbs and voice budget
+	// use the nearest one, the same way FMOD mixes sounds for multiple listeners
+	FMOD_VECTOR listener_positions[FMOD_MAX_LISTENERS] = {};
+	int listener_count = 1;
+
+	// Used to skip redundant and throttle distant position updates, see EngineParams
+	ChannelSpatialCache spatial_cache;
+	float spatial_epsilon_sq = 0;
+	unsigned far_update_interval = 1;
+	unsigned update_count = 0;
+
+	// See get_stats. Guarded by the same mutex as other state
+	MethodCounter method_counters[size_t(TimedMethod::Count)];
+
+	// Mixer clock (in samples) cached by begin_frame_clock, used for scheduling playback
+	unsigned long long frame_clock = 0;
+	int sample_rate = 0;
+
+	// Output mixes only on update, see render
+	bool is_nrt_output = false;
+
+	// Settings which are also needed to estimate audibility of sounds
+	float rolloff_scale = 1;
+	float master_volume = 1;
+	float vol0virtualvol = 0.01; // linear volume below which channel is considered to be completely silent
+
+	// Only reverb spheres nearest to the listener are applied, at most one per slot.
+	// Slots are created as needed.
+	SlotMap<ReverbPreset> reverb_presets;
+	std::vector<ReverbSlot> reverb_slots;
+	size_t max_active_reverbs = 8;
+	std::vector<std::pair<float, int>> reverb_candidates; // (-weight, ID), kept to avoid allocations
+
+	// Hash of file contents -> sound ID.
+	// Sounds loaded from memory are shared if contents are the same (compared by digest).
+	std::unordered_map<uint64_t, int> sound_cache;
+
+	// IDs of channels which stopped since last collect_finished_channels call.
+	// Filled from channel END callback, which FMOD calls from System::update.
+	std::vector<int> finished_channels;
 
-	// These are sparsed arrays - new values will fill vacant (nullptr) places if available,
-	// instead of increasing vector size.
-	// Array indices are used as IDs (called EngineId in Rust plugin).
-	
-	std::vector<FMOD::Sound*> sounds;
-	std::vector<FMOD::Channel*> channels;
-	std::vector<FMOD::Geometry*> geometries;
-	std::vector<FMOD::Reverb3D*> reverbs;
+	// Updates which can be queued from any thread without taking the state lock; applied in update().
+	// Channel updates are lock-free. Only the latest listener state is kept, it's also applied
+	// before anything which depends on the listener.
+	mutable CommandQueue<ChannelBatchEntry> channel_updates{16 * 1024};
+	mutable LatestValue<ListenerBatch> listener_updates;
+
+	// Optional thread which calls System::update at fixed rate, see InitParams.
+	// While it runs, all state is guarded by the mutex, except for queues.
+	bool use_update_thread = false;
+	std::thread update_thread;
+	std::atomic<bool> stop_update_thread{false};
+	std::recursive_mutex state_mutex;
 
 	/// Returns false on error. Must be called only once per bridge lifetime.
 	bool init(InitParams params);
 	~Bridge();
 
-	/// Creates group with default parameters if it doesn't exist
-	FMOD::ChannelGroup* get_group(int user_id);
+	/// Locks state_mutex if update thread is running, otherwise does nothing
+	std::unique_lock<std::recursive_mutex> lock_state();
+
+	/// Applies queued updates and updates FMOD system
+	void update_system();
+
+	/// Creates group with default parameters if it doesn't exist.
+	/// Returns default group (0) on invalid ID.
+	/// Reference is invalidated when another group is created.
+	GroupEntry& get_group(int user_id);
+	/// Returns false and logs error if ID is out of range
+	bool check_group_id(int user_id);
+	/// Creates, updates or removes effects of the group
+	void update_group_dsp(GroupEntry& entry, const GroupParams& params);
+	/// Disables effect if it exists
+	void remove_group_dsp(GroupEntry& entry, FMOD::DSP*& dsp);
+	/// Sets compressor sidechain input. Source group must already exist
+	void set_group_sidechain(GroupEntry& entry, int sidechain_id);
+	/// Volume of the group multiplied by volumes of all its parents
+	float total_group_volume(const GroupEntry& group);
+
+	/// Checks if non-blocking load is finished and updates the entry if it is
+	LoadState check_load_state(SoundEntry& entry);
+	/// Sets defaults of the template on the FMOD::Sound, if there is one and the sound is loaded
+	void apply_sound_template(SoundEntry& entry);
+
+	/// Creates geometry from polygons. Returns nullptr on error
+	FMOD::Geometry* create_geometry(const Geometry& params);
+	FMOD::Geometry* create_geometry(const FlatGeometry& params);
+	/// Returns geometry in FMOD binary format, or empty vector on error
+	std::vector<char> save_geometry(const FlatGeometry& params);
+	/// Creates geometry from saved data. Returns nullptr on error
+	FMOD::Geometry* load_geometry(const std::vector<char>& data);
+	/// Adds geometry to the world. Returns ID or -1 on error, in which case geometry is released
+	int insert_geometry(FMOD::Geometry* geometry);
+	/// Sets position, rotation and scale of the geometry
+	void set_geometry_transform(GeometryEntry& entry, const GeometryTransform& transform);
+	/// Activates geometry or its proxy depending on distance to the listener
+	void update_geometry_lod(GeometryEntry& entry);
+
+	/// Sets state of all listeners. Empty batch is ignored
+	void set_listeners(const ListenerBatch& batch);
+	/// Sets queued listener state, if any. Called before anything which depends on the listener,
+	/// so it doesn't use the previous one. Call must be inside locked scope
+	void apply_queued_listener_updates();
+	/// Distance to the nearest listener
+	float listener_distance(FMOD_VECTOR position) const;
+
+	/// Assigns slots to reverb spheres which affect the listener the most
+	void update_reverb_slots();
+	/// Frees slot used by reverb sphere, if any
+	void release_reverb_slot(ReverbEntry& entry);
+
+	/// Sets FMOD_ADVANCEDSETTINGS::vol0virtualvol
+	void set_virtual_volume(float volume);
+	/// Call must be inside locked scope, see lock_state
+	MethodCounter& method_counter(TimedMethod method) { return method_counters[size_t(method)]; }
+
+	/// Returns false if sound shouldn't be played at all, see play_channel
+	bool check_voice_budget(const ChannelParams& params, const SoundEntry& source, const GroupEntry& group);
+	/// Implementation of play_channel
+	int start_channel(const ChannelParams& params, GroupEntry& group);
+
+	/// Applies update to the channel. Returns false if sound stopped
+	bool apply_channel_update(int id, FMOD::Channel* channel, const ChannelUpdateParams& params);
+	/// Applies everything from channel_updates. Call must be inside locked scope
+	void apply_queued_channel_updates();
+	/// Returns true if new 3D attributes should be sent to the channel, updating the cache if so
+	bool check_spatial_update(int id, FMOD_VECTOR position, FMOD_VECTOR velocity);
+	/// Marks channels which are beyond max distance from the listener
+	void update_far_channels();
 
 	//
 	// Methods visible in Rust
 	//
 
-	/// Should be called frequently to update various internal states
+	/// Should be called frequently to update various internal states.
+	/// Applies all queued updates.
+	/// Does nothing if update thread is used.
 	void update();
 	void update_engine(EngineParams params);
 
+	/// Updates until mixer clock advances by at least this many samples (it advances by
+	/// whole mixer blocks), returns by how much it has advanced.
+	/// Works only with non-realtime output and without update thread;
+	/// mixing takes as much time as it needs, so results don't depend on CPU speed.
+	unsigned long long render(uint32_t samples);
+
+	/// Caches current mixer clock. Delays of all sounds played until the next call are
+	/// relative to this time, so sounds played at once start exactly at the same sample.
+	/// Should be called once per frame.
+	FrameClock begin_frame_clock();
+
+	/// Returns engine statistics; method counters are totals since the bridge was created
+	BridgeStats get_stats();
+
 	/// Sets new 3D listener state (where user's "ears" are in the world).
-    void update_listener(ListenerParams params);
-	/// Creates group if it doesn't exist
+	/// Same as update_listeners with a single listener.
+	void update_listener(ListenerParams params);
+	/// Sets state of all listeners, i.e. one per player in split-screen.
+	/// Number of listeners is the slice length (up to FMOD_MAX_LISTENERS); if it's empty,
+	/// previous state is kept.
+	void update_listeners(rust::Slice<const ListenerParams> listeners);
+	/// Same as update_listener, but can be called from any thread concurrently
+	/// with other queue_* methods; update is applied in update(), or earlier by any
+	/// method which depends on the listener. Newer update replaces older one if it wasn't applied yet.
+	void queue_listener_update(ListenerParams params) const;
+	/// Same as update_listeners, but queued like queue_listener_update
+	void queue_listener_updates(rust::Slice<const ListenerParams> listeners) const;
+	/// Creates group if it doesn't exist. Parent is created too
 	void update_group(GroupParams params);
 
-	/// Load sound into engine. Returns ID or -1 on error
+	/// Load sound into engine. Returns ID or -1 on error.
+	/// If same file contents were already loaded, returns ID of existing sound.
 	int load_audio_file(AudioFileParams params);
-	/// Unload sound. ID will be reused
+	/// Returns state of sound loaded with non_blocking flag; other sounds are always ready.
+	/// Sound can't be played until it's ready.
+	LoadState poll_load_state(int id);
+	/// Same as poll_load_state, but doesn't update the sound, so it can be called from any
+	/// thread concurrently with other const methods. bridge_sound_loaded is called each time
+	/// a load finishes, so this can be polled only after that.
+	LoadState load_state(int id) const;
+	/// Registers default parameters of channels playing the sound, so play_channel doesn't
+	/// need to set them if they are the same. Returns template ID or -1 on error.
+	///
+	/// Template is applied to the FMOD::Sound only if it's the only template of the sound
+	/// (i.e. the sound isn't shared by several users with their own defaults),
+	/// and not before the sound is loaded.
+	int add_sound_template(int sound_id, SoundTemplate params);
+	/// Changes parameters of existing template
+	void set_sound_template(int template_id, SoundTemplate params);
+	/// Must be called for each template before its sound is freed
+	void free_sound_template(int template_id);
+	/// Unload sound. Each successful load_audio_file call must be paired with this.
+	/// Sound is released when the last reference is freed; then ID will be reused.
 	void free_audio_file(int id);
 
-	/// Play sound. Returns ID or -1 on error or -2 if sound is not tracked.
+	/// Play sound. Returns ID or -1 on error.
+	/// Returns -3 without creating a channel if sound wouldn't be audible, if its group
+	/// already plays GroupParams::max_instances sounds, or if ChannelParams::cooldown
+	/// hasn't passed yet; this isn't logged.
 	/// ID won't be reused until 'free_channel' is called.
 	int play_channel(ChannelParams params);
+	/// Same as calling play_channel for each entry, returns IDs in the same order
+	rust::Vec<int> play_channels_batch(rust::Slice<const ChannelParams> entries);
 	/// Change parameters of playing sound. Returns false if sound stopped
 	bool update_channel(int id, ChannelUpdateParams params);
+	/// Same as calling update_channel for each entry.
+	/// Queued updates are applied first, so they can't overwrite newer ones from the batch.
+	/// Returns bitset: bit (i % 64) of element (i / 64) is set if sound of entry i is still playing.
+	rust::Vec<uint64_t> update_channels_batch(rust::Slice<const ChannelBatchEntry> entries);
+	/// Same as update_channels_batch, but can be called from any thread concurrently
+	/// with other queue_* methods; updates are applied in update().
+	/// Returns number of queued entries, which is less than total if the queue is full.
+	size_t queue_channel_updates(rust::Slice<const ChannelBatchEntry> entries) const;
 	/// Returns true if sound is currently playing, or false otherwise
 	bool is_playing_channel(int id);
+	/// Returns IDs of all channels which stopped playing since the last call.
+	/// These IDs are freed and will be reused, don't call free_channel for them.
+	rust::Vec<int> collect_finished_channels();
 	/// Stops playback. ID will be reused.
 	void free_channel(int id);
 
@@ -75,11 +435,37 @@ struct Bridge {
 	/// Geometry between a sound and the listener will decrease sound's volume.
 	/// Geometry between a sound and a center of reverb sphere will decrease reverb effect.
     int add_geometry(Geometry params);
+	/// Same as add_geometry, but vertices of all polygons are in a single array.
+	/// Passed buffers are used directly, without copying or allocations.
+	int add_geometry_flat(FlatGeometry params);
 	/// ID will be reused
     void free_geometry(int id);
 
+	/// Moves, rotates or scales geometry created by either add_geometry or add_geometry_instance
+	void update_geometry_transform(int id, GeometryTransform transform);
+
+	/// Stores geometry with polygons in local space, which can be used to create
+	/// any number of instances cheaply. Returns prototype ID or -1 on error.
+	int add_geometry_prototype(FlatGeometry params);
+	/// Converts geometry to binary format, which can be stored and later loaded
+	/// with load_geometry_prototype. Returns empty vector on error.
+	rust::Vec<uint8_t> bake_geometry(FlatGeometry params);
+	/// Creates prototype from result of bake_geometry.
+	/// Data is copied. Returns prototype ID or -1 on error.
+	int load_geometry_prototype(rust::Slice<const uint8_t> data);
+	/// ID will be reused. Instances are not affected
+	void free_geometry_prototype(int id);
+	/// Creates geometry from prototype; see add_geometry. Returns geometry ID or -1 on error.
+	/// Free it with free_geometry.
+	int add_geometry_instance(int prototype_id, GeometryTransform transform);
+	/// Sets level of detail of the geometry, depending on distance from the listener
+	/// to the geometry's bounding sphere. Replaces previous settings.
+	/// See GeometryLod in bridge.rs for details.
+	void set_geometry_lod(int id, GeometryLod params);
+
 	/// 3D-world reverb sphere. Returns ID or -1 on error.
 	/// Will apply reverb effect to sounds within the sphere.
+	/// Only up to EngineParams::max_active_reverbs spheres nearest to the listener are applied.
 	/// Effect can be occluded by geometry, see add_geometry for more info.
     int add_reverb(Reverb params);
 	/// ID will be reused
@@ -91,4 +477,8 @@ struct Bridge {
 /// Returns nullptr on error.
 std::unique_ptr<Bridge> create(InitParams params);
 
+/// Completes read started by bridge_file_read_async; can be called from any thread.
+/// Less data than requested means end of file. Must be called exactly once per request.
+void file_read_done(size_t request, rust::Slice<const uint8_t> data, bool ok);
+
 #endif // BRIDGE_H
@@ -0,0 +1,111 @@
+#ifndef COMMAND_QUEUE_H
+#define COMMAND_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+// Bounded lock-free multi-producer multi-consumer queue (Dmitry Vyukov's algorithm).
+// Each cell has a sequence number telling whether it's ready to be written or read,
+// so producers only contend on a single atomic counter.
+template<typename T>
+struct CommandQueue {
+	struct Cell {
+		std::atomic<size_t> sequence;
+		T value;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+
+	alignas(64) std::atomic<size_t> enqueue_pos{0};
+	alignas(64) std::atomic<size_t> dequeue_pos{0};
+
+	/// Capacity is rounded up to the power of two
+	explicit CommandQueue(size_t capacity) {
+		size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+
+		cells.reset(new Cell[size]);
+		mask = size - 1;
+		for (size_t i = 0; i < size; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	/// Returns false if queue is full
+	bool push(const T& value) {
+		Cell* cell = nullptr;
+		size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+			if (diff == 0) {
+				if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false; // cell wasn't read yet
+			else
+				pos = enqueue_pos.load(std::memory_order_relaxed); // other producer took the cell
+		}
+
+		cell->value = value;
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	/// Returns false if queue is empty
+	bool pop(T& value) {
+		Cell* cell = nullptr;
+		size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+		for (;;) {
+			cell = &cells[pos & mask];
+			const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			const intptr_t diff = intptr_t(sequence) - intptr_t(pos + 1);
+			if (diff == 0) {
+				if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false; // cell wasn't written yet
+			else
+				pos = dequeue_pos.load(std::memory_order_relaxed); // other consumer took the cell
+		}
+
+		value = cell->value;
+		cell->sequence.store(pos + mask + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+// Single-value mailbox for updates where only the latest one matters: newer value
+// replaces the one which wasn't taken yet, so it can't overflow.
+// Lock is held only while the value is copied.
+template<typename T>
+struct LatestValue {
+	std::mutex mutex;
+	T value = {};
+	bool has_value = false;
+
+	void push(const T& new_value) {
+		std::lock_guard lock(mutex);
+		value = new_value;
+		has_value = true;
+	}
+
+	/// Returns false if there is no new value since the last call
+	bool pop(T& out) {
+		std::lock_guard lock(mutex);
+		if (!has_value)
+			return false;
+		out = value;
+		has_value = false;
+		return true;
+	}
+};
+
+#endif // COMMAND_QUEUE_H
@@ -0,0 +1,161 @@
+#ifndef POOL_ALLOCATOR_H
+#define POOL_ALLOCATOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+// Thread-safe allocator with a hard limit on memory taken from the system heap.
+// Small blocks are rounded up to power-of-two size classes and carved from large chunks;
+// freed ones are kept in per-class free lists and reused, so they never go back to the heap.
+// Larger blocks are allocated from the heap directly.
+struct PoolAllocator {
+	// before each block, keeps returned pointers 16-byte aligned
+	struct Header {
+		size_t size; // block size including header
+		size_t padding;
+	};
+	static_assert(sizeof(Header) == 16, "Header must keep alignment");
+
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+
+	static constexpr size_t min_block = 32;
+	static constexpr int class_count = 8; // 32 .. 4096 bytes
+	static constexpr size_t max_block = min_block << (class_count - 1);
+	static constexpr size_t chunk_size = 256 * 1024;
+
+	std::mutex mutex;
+	FreeBlock* free_lists[class_count] = {};
+	std::vector<void*> chunks;
+	char* chunk_pos = nullptr;
+	char* chunk_end = nullptr;
+
+	size_t limit; // 0 for unlimited
+	size_t reserved = 0; // taken from system heap
+
+	explicit PoolAllocator(size_t limit): limit(limit) {}
+
+	PoolAllocator(const PoolAllocator&) = delete;
+	PoolAllocator& operator=(const PoolAllocator&) = delete;
+
+	~PoolAllocator() {
+		for (auto chunk : chunks)
+			std::free(chunk);
+	}
+
+	/// Returns nullptr if limit is reached
+	void* alloc(size_t size) {
+		const size_t total = size + sizeof(Header);
+		std::lock_guard lock(mutex);
+
+		void* block = nullptr;
+		size_t block_size = total;
+		if (total <= max_block) {
+			const int index = class_index(total);
+			block_size = min_block << index;
+
+			if (auto free = free_lists[index]) {
+				free_lists[index] = free->next;
+				block = free;
+			}
+			else {
+				if (size_t(chunk_end - chunk_pos) < block_size && !add_chunk())
+					return nullptr;
+				block = chunk_pos;
+				chunk_pos += block_size;
+			}
+		}
+		else {
+			if (!reserve(total))
+				return nullptr;
+			block = std::malloc(total);
+			if (!block) {
+				reserved -= total;
+				return nullptr;
+			}
+		}
+
+		auto header = static_cast<Header*>(block);
+		header->size = block_size;
+		return header + 1;
+	}
+
+	void* realloc(void* ptr, size_t size) {
+		if (!ptr)
+			return alloc(size);
+
+		const size_t old_size = (static_cast<Header*>(ptr) - 1)->size - sizeof(Header);
+		if (size <= old_size && old_size + sizeof(Header) <= max_block)
+			return ptr; // still fits into the same size class
+
+		void* new_ptr = alloc(size);
+		if (!new_ptr)
+			return nullptr; // old block must stay valid
+		std::memcpy(new_ptr, ptr, std::min(old_size, size));
+		free(ptr);
+		return new_ptr;
+	}
+
+	void free(void* ptr) {
+		if (!ptr)
+			return;
+
+		auto header = static_cast<Header*>(ptr) - 1;
+		const size_t block_size = header->size;
+		std::lock_guard lock(mutex);
+
+		if (block_size <= max_block) {
+			const int index = class_index(block_size);
+			auto block = reinterpret_cast<FreeBlock*>(header);
+			block->next = free_lists[index];
+			free_lists[index] = block;
+		}
+		else {
+			std::free(header);
+			reserved -= block_size;
+		}
+	}
+
+	/// Bytes taken from system heap, including unused space in chunks
+	size_t reserved_bytes() {
+		std::lock_guard lock(mutex);
+		return reserved;
+	}
+
+private:
+	static int class_index(size_t size) {
+		int index = 0;
+		while ((min_block << index) < size)
+			++index;
+		return index;
+	}
+
+	bool reserve(size_t size) {
+		if (limit && reserved + size > limit)
+			return false;
+		reserved += size;
+		return true;
+	}
+
+	// rest of the current chunk is lost, but it's less than max_block
+	bool add_chunk() {
+		if (!reserve(chunk_size))
+			return false;
+		auto chunk = static_cast<char*>(std::malloc(chunk_size));
+		if (!chunk) {
+			reserved -= chunk_size;
+			return false;
+		}
+		chunks.push_back(chunk);
+		chunk_pos = chunk;
+		chunk_end = chunk + chunk_size;
+		return true;
+	}
+};
+
+#endif // POOL_ALLOCATOR_H
@@ -0,0 +1,117 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// SHA-256 digest (FIPS 180-4). Used as identity of sound file contents, where collision
+// of a weaker hash would silently make one sound play instead of another.
+struct Sha256 {
+	using Digest = std::array<uint8_t, 32>;
+
+	uint32_t state[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	uint8_t block[64] = {};
+	size_t block_size = 0; // number of bytes in block
+	uint64_t total_size = 0; // bytes added so far
+
+	void add(const uint8_t* data, size_t size) {
+		total_size += size;
+
+		if (block_size) {
+			const size_t n = std::min(size, sizeof(block) - block_size);
+			std::memcpy(block + block_size, data, n);
+			block_size += n;
+			data += n;
+			size -= n;
+			if (block_size < sizeof(block))
+				return;
+			process(block);
+			block_size = 0;
+		}
+
+		for (; size >= sizeof(block); data += sizeof(block), size -= sizeof(block))
+			process(data);
+
+		std::memcpy(block, data, size);
+		block_size = size;
+	}
+
+	/// Object can't be used after this
+	Digest finish() {
+		const uint64_t bit_size = total_size * 8;
+
+		block[block_size++] = 0x80;
+		if (block_size > sizeof(block) - 8) {
+			std::memset(block + block_size, 0, sizeof(block) - block_size);
+			process(block);
+			block_size = 0;
+		}
+		std::memset(block + block_size, 0, sizeof(block) - 8 - block_size);
+		for (int i = 0; i < 8; ++i)
+			block[56 + i] = uint8_t(bit_size >> (56 - i * 8));
+		process(block);
+
+		Digest digest;
+		for (int i = 0; i < 8; ++i) {
+			for (int j = 0; j < 4; ++j)
+				digest[i * 4 + j] = uint8_t(state[i] >> (24 - j * 8));
+		}
+		return digest;
+	}
+
+	static Digest of(const uint8_t* data, size_t size) {
+		Sha256 sha;
+		sha.add(data, size);
+		return sha.finish();
+	}
+
+private:
+	static uint32_t rotate(uint32_t x, int n) {
+		return (x >> n) | (x << (32 - n));
+	}
+
+	void process(const uint8_t* data) {
+		static constexpr uint32_t k[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+		};
+
+		uint32_t w[64];
+		for (int i = 0; i < 16; ++i)
+			w[i] = uint32_t(data[i * 4]) << 24 | uint32_t(data[i * 4 + 1]) << 16 | uint32_t(data[i * 4 + 2]) << 8 | data[i * 4 + 3];
+		for (int i = 16; i < 64; ++i) {
+			const uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+			const uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+		for (int i = 0; i < 64; ++i) {
+			const uint32_t s1 = rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25);
+			const uint32_t ch = (e & f) ^ (~e & g);
+			const uint32_t t1 = h + s1 + ch + k[i] + w[i];
+			const uint32_t s0 = rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22);
+			const uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+			const uint32_t t2 = s0 + maj;
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+	}
+};
+
+#endif // SHA256_H
@@ -0,0 +1,108 @@
+#ifndef SLOT_MAP_H
+#define SLOT_MAP_H
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Sparse array with O(1) insertion and removal.
+// Vacant slots form an intrusive free list and are reused before the vector grows.
+//
+// ID is slot index combined with slot generation, which is incremented each time
+// the slot is vacated - so IDs of removed objects are detected as invalid instead of
+// silently referring to a new object. IDs are always non-negative.
+template<typename T>
+struct SlotMap {
+	static constexpr int index_bits = 20; // up to ~1M objects
+	static constexpr int index_mask = (1 << index_bits) - 1;
+	static constexpr int generation_mask = (1 << (31 - index_bits)) - 1; // wraps around after 2048 reuses
+
+	struct Slot {
+		T value = {};
+		int generation = 0;
+		int next_free = -1; // index of next vacant slot (only if this one is vacant too)
+		bool used = false;
+	};
+
+	std::vector<Slot> slots;
+	int free_head = -1; // index of first vacant slot or -1
+	int count = 0; // number of used slots
+
+	static int index_of(int id) { return id & index_mask; }
+
+	/// Returns ID or -1 if there is no space left
+	int insert(T value) {
+		int i = free_head;
+		if (i != -1)
+			free_head = slots[i].next_free;
+		else {
+			if (slots.size() > size_t(index_mask))
+				return -1;
+			i = slots.size();
+			slots.emplace_back();
+		}
+
+		auto& slot = slots[i];
+		slot.value = std::move(value);
+		slot.next_free = -1;
+		slot.used = true;
+		++count;
+		return (slot.generation << index_bits) | i;
+	}
+
+	/// Makes sure that next `n` insertions won't reallocate
+	void reserve(size_t n) {
+		const size_t vacant = slots.size() - count;
+		if (n <= vacant)
+			return;
+		const size_t required = slots.size() + (n - vacant);
+		if (required > slots.capacity())
+			slots.reserve(std::max(required, slots.capacity() * 2)); // keep growth amortized
+	}
+
+	/// Returns nullptr if ID is invalid or was removed
+	T* get(int id) {
+		if (id < 0)
+			return nullptr;
+		const size_t i = index_of(id);
+		if (i >= slots.size())
+			return nullptr;
+		auto& slot = slots[i];
+		if (!slot.used || slot.generation != (id >> index_bits))
+			return nullptr;
+		return &slot.value;
+	}
+
+	const T* get(int id) const {
+		return const_cast<SlotMap*>(this)->get(id);
+	}
+
+	/// Returns false if ID is invalid or was removed
+	bool remove(int id) {
+		if (!get(id))
+			return false;
+
+		const int i = index_of(id);
+		auto& slot = slots[i];
+		slot.value = {};
+		slot.generation = (slot.generation + 1) & generation_mask;
+		slot.next_free = free_head;
+		slot.used = false;
+		free_head = i;
+		--count;
+		return true;
+	}
+
+	/// Calls f(id, value) for each existing object
+	template<typename F>
+	void for_each(F&& f) {
+		for (size_t i = 0; i < slots.size(); ++i) {
+			auto& slot = slots[i];
+			if (slot.used)
+				f((slot.generation << index_bits) | int(i), slot.value);
+		}
+	}
+};
+
+#endif // SLOT_MAP_H
@@ -0,0 +1,28 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <cstdio>
+
+// Minimal test helpers for standalone tests of bridge headers which don't depend on FMOD
+
+static int failed_checks = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			std::printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+			++failed_checks; \
+		} \
+	} while (0)
+
+/// Returns exit code for main
+static int report_checks() {
+	if (failed_checks) {
+		std::printf("%d checks failed\n", failed_checks);
+		return 1;
+	}
+	std::printf("all checks passed\n");
+	return 0;
+}
+
+#endif // TESTS_CHECK_H
@@ -0,0 +1,140 @@
+// Build and run from the crate root:
+//   g++ -std=c++17 -pthread src-cpp/tests/command_queue.cpp -o command_queue_test && ./command_queue_test
+
+#include "check.h"
+#include "../command_queue.h"
+
+#include <thread>
+#include <vector>
+
+//
+// CommandQueue
+
+static void queue_empty() {
+	CommandQueue<int> queue(4);
+	int value = -1;
+	CHECK(!queue.pop(value));
+	CHECK(value == -1);
+
+	CHECK(queue.push(1));
+	CHECK(queue.pop(value) && value == 1);
+	CHECK(!queue.pop(value));
+}
+
+static void queue_full() {
+	CommandQueue<int> queue(4);
+	for (int i = 0; i < 4; ++i)
+		CHECK(queue.push(i));
+	CHECK(!queue.push(4));
+
+	// freed cell can be used again, order is kept
+	int value = -1;
+	CHECK(queue.pop(value) && value == 0);
+	CHECK(queue.push(4));
+	CHECK(!queue.push(5));
+
+	for (int i = 1; i <= 4; ++i)
+		CHECK(queue.pop(value) && value == i);
+	CHECK(!queue.pop(value));
+}
+
+static void queue_capacity() {
+	CommandQueue<int> queue(5); // rounded up to 8
+	int pushed = 0;
+	while (queue.push(pushed))
+		++pushed;
+	CHECK(pushed == 8);
+}
+
+static void queue_producers() {
+	constexpr int producers = 4;
+	constexpr int per_producer = 10000;
+	CommandQueue<int> queue(producers * per_producer);
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < producers; ++t) {
+		threads.emplace_back([&queue, t] {
+			for (int i = 0; i < per_producer; ++i)
+				queue.push(t * per_producer + i);
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	// each value exactly once, and in order for each producer
+	std::vector<int> last(producers, -1);
+	int count = 0;
+	int value;
+	while (queue.pop(value)) {
+		const int t = value / per_producer;
+		CHECK(value % per_producer > last[t]);
+		last[t] = value % per_producer;
+		++count;
+	}
+	CHECK(count == producers * per_producer);
+}
+
+//
+// LatestValue
+
+static void latest_value() {
+	LatestValue<int> latest;
+	int value = -1;
+	CHECK(!latest.pop(value));
+
+	// never overflows, newer value replaces the older one
+	for (int i = 0; i < 100; ++i)
+		latest.push(i);
+	CHECK(latest.pop(value) && value == 99);
+	CHECK(!latest.pop(value));
+
+	latest.push(5);
+	CHECK(latest.pop(value) && value == 5);
+}
+
+static void latest_value_producers() {
+	constexpr int producers = 4;
+	constexpr int per_producer = 10000;
+	LatestValue<int> latest;
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < producers; ++t) {
+		threads.emplace_back([&latest, t] {
+			for (int i = 0; i < per_producer; ++i)
+				latest.push(t * per_producer + i);
+		});
+	}
+
+	// values of each producer are seen in order
+	std::vector<int> last(producers, -1);
+	bool ordered = true;
+	auto check = [&](int value) {
+		const int t = value / per_producer;
+		ordered &= value % per_producer > last[t];
+		last[t] = value % per_producer;
+	};
+
+	int value;
+	for (int i = 0; i < 1000; ++i) {
+		if (latest.pop(value))
+			check(value);
+	}
+	for (auto& thread : threads)
+		thread.join();
+	if (latest.pop(value)) {
+		check(value);
+		CHECK(value % per_producer == per_producer - 1); // last push of some producer
+	}
+	CHECK(ordered);
+}
+
+int main() {
+	queue_empty();
+	queue_full();
+	queue_capacity();
+	queue_producers();
+
+	latest_value();
+	latest_value_producers();
+	return report_checks();
+}
@@ -0,0 +1,73 @@
+// Build and run from the crate root:
+//   g++ -std=c++17 src-cpp/tests/slot_map.cpp -o slot_map_test && ./slot_map_test
+
+#include "check.h"
+#include "../slot_map.h"
+
+static void stale_id() {
+	SlotMap<int> map;
+	const int a = map.insert(1);
+	CHECK(a >= 0);
+	CHECK(map.get(a) && *map.get(a) == 1);
+
+	CHECK(map.remove(a));
+	CHECK(!map.get(a));
+	CHECK(!map.remove(a));
+
+	// slot is reused, but old ID must not refer to the new object
+	const int b = map.insert(2);
+	CHECK(SlotMap<int>::index_of(b) == SlotMap<int>::index_of(a));
+	CHECK(b != a);
+	CHECK(!map.get(a));
+	CHECK(!map.remove(a));
+	CHECK(map.get(b) && *map.get(b) == 2);
+	CHECK(map.count == 1);
+}
+
+static void invalid_id() {
+	SlotMap<int> map;
+	CHECK(!map.get(-1));
+	CHECK(!map.get(0));
+	CHECK(!map.remove(0));
+
+	const int a = map.insert(1);
+	CHECK(!map.get(a + 1)); // index past the end
+	CHECK(!map.get(a + (1 << SlotMap<int>::index_bits))); // wrong generation
+}
+
+static void generation_wraps() {
+	SlotMap<int> map;
+	map.remove(map.insert(0));
+
+	// IDs stay non-negative after generation wraps around
+	for (int i = 0; i < SlotMap<int>::generation_mask + 10; ++i) {
+		const int id = map.insert(i);
+		CHECK(id >= 0);
+		CHECK(map.remove(id));
+	}
+}
+
+static void free_list_reuse() {
+	SlotMap<int> map;
+	const int a = map.insert(1), b = map.insert(2), c = map.insert(3);
+	map.remove(b);
+	map.remove(a);
+
+	// vacated slots are reused before the vector grows
+	map.insert(4);
+	map.insert(5);
+	CHECK(map.slots.size() == 3);
+	CHECK(map.get(c) && *map.get(c) == 3);
+
+	int sum = 0;
+	map.for_each([&](int, int value) { sum += value; });
+	CHECK(sum == 3 + 4 + 5);
+}
+
+int main() {
+	stale_id();
+	invalid_id();
+	generation_wraps();
+	free_list_reuse();
+	return report_checks();
+}
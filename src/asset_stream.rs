@@ -0,0 +1,547 @@
+//! Reading files through bevy asset sources for the engine, see
+//! `AudioFileParams::use_file_callbacks`.
+//!
+//! Engine requests reads asynchronously. Requests of one stream are served in
+//! order by a task on [`IoTaskPool`], which passes data to the engine with
+//! `file_read_done`, so the engine's file thread isn't blocked by bevy I/O.
+//!
+//! Bevy readers can't seek or tell file size, so:
+//! - size is found by reading the file through once. Asset loader does this
+//!   with the reader it already has (see [`scan`]); otherwise it's done when
+//!   the engine opens the file, blocking the engine's thread;
+//! - the beginning of the file is kept in memory. The engine seeks back and
+//!   forth there while parsing headers and when looping, so that doesn't
+//!   re-open the file;
+//! - seeking forward skips data, and seeking backward past the beginning
+//!   re-opens the file.
+//!
+//! This is cached only while the file is used: by [`ScannedFile`] (which is
+//! kept by `AudioSource`) or by an open stream.
+
+use bevy::{
+    asset::{
+        io::{AssetSourceId, Reader},
+        AssetPath, AssetServer, AsyncReadExt as _,
+    },
+    log::error,
+    tasks::{
+        futures_lite::{future::block_on, AsyncRead},
+        IoTaskPool,
+    },
+    utils::{BoxedFuture, HashMap},
+};
+use std::{
+    collections::VecDeque,
+    path::Path,
+    sync::{
+        atomic::{AtomicU64, Ordering},
+        Arc, Mutex, OnceLock, Weak,
+    },
+};
+
+/// Set once by the plugin
+static ASSET_SERVER: OnceLock<AssetServer> = OnceLock::new();
+
+lazy_static::lazy_static! {
+    static ref STREAMS: Mutex<HashMap<u64, Arc<Mutex<StreamState>>>> = Default::default();
+
+    /// Files which are used now, by file name passed to the engine
+    static ref FILES: Mutex<HashMap<String, Weak<CachedFile>>> = Default::default();
+}
+
+/// Always non-zero
+static NEXT_HANDLE: AtomicU64 = AtomicU64::new(1);
+
+/// Max number of bytes read at once while skipping data
+const SKIP_CHUNK: usize = 16 * 1024;
+
+/// Size of the beginning of a file kept in memory
+const HEAD_SIZE: usize = 64 * 1024;
+
+/// Must be called before any file is opened
+pub fn register(server: AssetServer) {
+    let _ = ASSET_SERVER.set(server);
+}
+
+/// Result of [`scan`], file stays cached while this exists
+pub struct ScannedFile {
+    _file: Arc<CachedFile>,
+}
+
+/// Reads file through `reader` to find its size, so [`open`] doesn't have to.
+/// `name` is the one passed to the engine.
+pub async fn scan<R: AsyncRead + Unpin + ?Sized>(
+    name: String,
+    reader: &mut R,
+) -> Result<ScannedFile, String> {
+    let info = FileInfo::read(reader).await?;
+    let file = Arc::new(CachedFile::new(name, info)?);
+    FILES
+        .lock()
+        .unwrap()
+        .insert(file.name.clone(), Arc::downgrade(&file));
+    Ok(ScannedFile { _file: file })
+}
+
+/// Returns handle, or 0 on error
+pub fn open(name: &str, file_size: &mut u32) -> u64 {
+    match AssetStream::new(name) {
+        Ok(stream) => {
+            let Ok(size) = u32::try_from(stream.file.info.size) else {
+                error!("can't stream \"{name}\": file is too large");
+                return 0;
+            };
+            *file_size = size;
+
+            let handle = NEXT_HANDLE.fetch_add(1, Ordering::Relaxed);
+            let state = StreamState {
+                stream: Some(stream),
+                requests: VecDeque::new(),
+            };
+            STREAMS
+                .lock()
+                .unwrap()
+                .insert(handle, Arc::new(Mutex::new(state)));
+            handle
+        }
+        Err(e) => {
+            error!("can't stream \"{name}\": {e}");
+            0
+        }
+    }
+}
+
+/// Engine cancels (waits for) all reads before closing the file
+pub fn close(handle: u64) {
+    let state = STREAMS.lock().unwrap().remove(&handle);
+    drop(state); // may free the cached file, which locks FILES
+}
+
+/// Starts reading `size` bytes at `offset`. Request is completed later from
+/// I/O task, or immediately on error.
+pub fn read_async(handle: u64, request: usize, offset: u32, size: u32) {
+    let Some(state) = STREAMS.lock().unwrap().get(&handle).cloned() else {
+        error!("can't read file: invalid handle {handle}");
+        complete(request, &[], false);
+        return;
+    };
+
+    let stream = {
+        let mut state = state.lock().unwrap();
+        state.requests.push_back(ReadRequest {
+            id: request,
+            offset,
+            size,
+        });
+        state.stream.take() // None if the task is already running, it will serve this request too
+    };
+    if let Some(stream) = stream {
+        IoTaskPool::get().spawn(serve(state, stream)).detach();
+    }
+}
+
+struct ReadRequest {
+    /// Passed back to the engine
+    id: usize,
+    offset: u32,
+    size: u32,
+}
+
+struct StreamState {
+    /// None while it's used by [`serve`]
+    stream: Option<AssetStream>,
+    requests: VecDeque<ReadRequest>,
+}
+
+/// Serves requests in order until there are none left, then returns the stream
+async fn serve(state: Arc<Mutex<StreamState>>, mut stream: AssetStream) {
+    let mut buffer = vec![];
+    loop {
+        let request = {
+            let mut state = state.lock().unwrap();
+            match state.requests.pop_front() {
+                Some(request) => request,
+                None => {
+                    state.stream = Some(stream);
+                    return;
+                }
+            }
+        };
+
+        buffer.resize(request.size as usize, 0);
+        stream.position = request.offset as u64;
+        match stream.read(&mut buffer).await {
+            Ok(count) => complete(request.id, &buffer[..count], true),
+            Err(e) => {
+                error!("can't read \"{}\": {e}", stream.file.name);
+                complete(request.id, &[], false);
+            }
+        }
+    }
+}
+
+fn complete(request: usize, data: &[u8], ok: bool) {
+    // SAFETY: request comes from the engine and is completed exactly once
+    unsafe { crate::bridge::bridge::file_read_done(request, data, ok) }
+}
+
+/// What is known about a file without reading it again
+struct FileInfo {
+    size: u64,
+    /// First `HEAD_SIZE` bytes, or the whole file if it's smaller
+    head: Vec<u8>,
+}
+
+impl FileInfo {
+    async fn read<R: AsyncRead + Unpin + ?Sized>(reader: &mut R) -> Result<Self, String> {
+        let mut head = vec![0; HEAD_SIZE];
+        let head_size = read_full(reader, &mut head).await?;
+        head.truncate(head_size);
+
+        let rest = if head_size == HEAD_SIZE {
+            skip(reader, u64::MAX).await?
+        } else {
+            0
+        };
+
+        Ok(Self {
+            size: head_size as u64 + rest,
+            head,
+        })
+    }
+}
+
+/// Entry of [`FILES`], removed from there when dropped
+struct CachedFile {
+    name: String,
+    source: AssetSourceId<'static>,
+    /// Readers borrow it, see [`asset_reader`]
+    path: Box<Path>,
+    info: FileInfo,
+}
+
+impl CachedFile {
+    fn new(name: String, info: FileInfo) -> Result<Self, String> {
+        let asset_path = AssetPath::try_parse(&name)
+            .map_err(|e| e.to_string())?
+            .into_owned();
+        Ok(Self {
+            source: asset_path.source().clone(),
+            path: asset_path.path().into(),
+            name,
+            info,
+        })
+    }
+}
+
+impl Drop for CachedFile {
+    fn drop(&mut self) {
+        let mut files = FILES.lock().unwrap();
+        // file could've been scanned again since
+        if files
+            .get(&self.name)
+            .is_some_and(|file| file.strong_count() == 0)
+        {
+            files.remove(&self.name);
+        }
+    }
+}
+
+/// Opens a new reader positioned at the start of the file
+type OpenReader =
+    Box<dyn Fn() -> BoxedFuture<'static, Result<Box<Reader<'static>>, String>> + Send + Sync>;
+
+struct AssetStream {
+    /// None until the first read past the head.
+    /// Borrows path of `file`, so it's declared (and dropped) before it.
+    reader: Option<Box<Reader<'static>>>,
+    file: Arc<CachedFile>,
+    open: OpenReader,
+
+    /// Position of `reader`
+    reader_position: u64,
+    /// Position requested by the engine
+    position: u64,
+}
+
+impl AssetStream {
+    fn new(name: &str) -> Result<Self, String> {
+        let cached = FILES.lock().unwrap().get(name).and_then(Weak::upgrade);
+        let file = match cached {
+            Some(file) => file,
+            None => {
+                // not scanned by asset loader
+                let asset_path = AssetPath::try_parse(name).map_err(|e| e.to_string())?;
+                let info = block_on(async {
+                    let mut reader =
+                        read_asset(asset_path.source().clone(), asset_path.path()).await?;
+                    FileInfo::read(&mut reader).await
+                })?;
+
+                let file = Arc::new(CachedFile::new(name.to_string(), info)?);
+                FILES
+                    .lock()
+                    .unwrap()
+                    .insert(name.to_string(), Arc::downgrade(&file));
+                file
+            }
+        };
+
+        let open = asset_reader(file.clone());
+        Ok(Self::with_reader(file, open))
+    }
+
+    fn with_reader(file: Arc<CachedFile>, open: OpenReader) -> Self {
+        Self {
+            reader: None,
+            file,
+            open,
+            reader_position: 0,
+            position: 0,
+        }
+    }
+
+    async fn read(&mut self, buffer: &mut [u8]) -> Result<usize, String> {
+        let info = &self.file.info;
+        if self.position >= info.size {
+            return Ok(0);
+        }
+        let mut count = 0;
+
+        if self.position < info.head.len() as u64 {
+            let start = self.position as usize;
+            count = (info.head.len() - start).min(buffer.len());
+            buffer[..count].copy_from_slice(&info.head[start..start + count]);
+            self.position += count as u64;
+
+            if count == buffer.len() || self.position >= info.size {
+                return Ok(count);
+            }
+        }
+
+        if self.reader.is_none() || self.position < self.reader_position {
+            self.reader = Some((self.open)().await?);
+            self.reader_position = 0;
+        }
+        let reader = self.reader.as_mut().unwrap();
+
+        let skipped = skip(reader, self.position - self.reader_position).await?;
+        self.reader_position += skipped;
+        if self.reader_position < self.position {
+            return Ok(count); // seek past the end
+        }
+
+        let n = read_full(reader, &mut buffer[count..]).await?;
+        self.reader_position += n as u64;
+        self.position = self.reader_position;
+        Ok(count + n)
+    }
+}
+
+fn asset_reader(file: Arc<CachedFile>) -> OpenReader {
+    Box::new(move || {
+        let file = file.clone();
+        Box::pin(async move {
+            // SAFETY: path is boxed, so it stays in place while the file
+            // exists, and `AssetStream` drops readers before the file
+            let path: &'static Path = unsafe { &*(file.path.as_ref() as *const Path) };
+            read_asset(file.source.clone(), path).await
+        })
+    })
+}
+
+async fn read_asset<'a>(
+    source: AssetSourceId<'a>,
+    path: &'a Path,
+) -> Result<Box<Reader<'a>>, String> {
+    let server = ASSET_SERVER
+        .get()
+        .ok_or_else(|| "asset server is not registered".to_string())?;
+    let source = server.get_source(source).map_err(|e| e.to_string())?;
+    source.reader().read(path).await.map_err(|e| e.to_string())
+}
+
+/// Reads until buffer is full or file ends. Returns number of bytes read.
+async fn read_full<R: AsyncRead + Unpin + ?Sized>(
+    reader: &mut R,
+    buffer: &mut [u8],
+) -> Result<usize, String> {
+    let mut count = 0;
+    while count < buffer.len() {
+        let n = reader
+            .read(&mut buffer[count..])
+            .await
+            .map_err(|e| e.to_string())?;
+        if n == 0 {
+            break;
+        }
+        count += n;
+    }
+    Ok(count)
+}
+
+/// Reads and discards data. Returns number of bytes skipped, which is less
+/// than requested only at the end of file.
+async fn skip<R: AsyncRead + Unpin + ?Sized>(reader: &mut R, count: u64) -> Result<u64, String> {
+    let mut chunk = [0; SKIP_CHUNK];
+    let mut skipped = 0;
+    while skipped < count {
+        let max = (count - skipped).min(SKIP_CHUNK as u64) as usize;
+        let n = reader
+            .read(&mut chunk[..max])
+            .await
+            .map_err(|e| e.to_string())?;
+        if n == 0 {
+            break;
+        }
+        skipped += n as u64;
+    }
+    Ok(skipped)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use bevy::tasks::futures_lite::io::Cursor;
+    use std::sync::atomic::AtomicUsize;
+
+    fn make_file(size: usize) -> Vec<u8> {
+        (0..size).map(|i| (i % 251) as u8).collect()
+    }
+
+    /// Returns stream and number of times it opened the file
+    fn make_stream(data: Vec<u8>) -> (AssetStream, Arc<AtomicUsize>) {
+        let info = block_on(FileInfo::read(&mut Cursor::new(&data))).unwrap();
+        let file = Arc::new(CachedFile::new("test".to_string(), info).unwrap());
+        let opens = Arc::new(AtomicUsize::new(0));
+
+        let data = Arc::new(data);
+        let open_count = opens.clone();
+        let open: OpenReader = Box::new(move || {
+            open_count.fetch_add(1, Ordering::Relaxed);
+            let reader: Box<Reader<'static>> = Box::new(Cursor::new(data.as_ref().clone()));
+            Box::pin(async move { Ok(reader) })
+        });
+
+        (AssetStream::with_reader(file, open), opens)
+    }
+
+    fn read_at(stream: &mut AssetStream, position: u64, size: usize) -> Vec<u8> {
+        stream.position = position;
+        let mut buffer = vec![0; size];
+        let count = block_on(stream.read(&mut buffer)).unwrap();
+        buffer.truncate(count);
+        buffer
+    }
+
+    #[test]
+    fn file_info() {
+        let data = make_file(HEAD_SIZE * 3 + 5);
+        let info = block_on(FileInfo::read(&mut Cursor::new(&data))).unwrap();
+        assert_eq!(info.size, data.len() as u64);
+        assert_eq!(info.head, data[..HEAD_SIZE]);
+
+        let data = make_file(100);
+        let info = block_on(FileInfo::read(&mut Cursor::new(&data))).unwrap();
+        assert_eq!(info.size, 100);
+        assert_eq!(info.head, data);
+    }
+
+    #[test]
+    fn scanned_file_is_cached_while_kept() {
+        let name = "scanned.ogg";
+        let data = make_file(100);
+        let file = block_on(scan(name.to_string(), &mut Cursor::new(&data))).unwrap();
+        let cached = FILES.lock().unwrap().get(name).and_then(Weak::upgrade);
+        assert_eq!(cached.unwrap().info.size, 100);
+
+        drop(file);
+        assert!(!FILES.lock().unwrap().contains_key(name));
+    }
+
+    #[test]
+    fn sequential_read() {
+        let data = make_file(HEAD_SIZE * 3 + 5);
+        let (mut stream, opens) = make_stream(data.clone());
+
+        let mut result = vec![];
+        let mut buffer = vec![0; 10000];
+        loop {
+            let count = block_on(stream.read(&mut buffer)).unwrap();
+            if count == 0 {
+                break;
+            }
+            result.extend_from_slice(&buffer[..count]);
+        }
+        assert_eq!(result, data);
+        assert_eq!(opens.load(Ordering::Relaxed), 1);
+    }
+
+    #[test]
+    fn head_is_cached() {
+        let data = make_file(HEAD_SIZE * 2);
+        let (mut stream, opens) = make_stream(data.clone());
+
+        assert_eq!(read_at(&mut stream, 100, 50), data[100..150]);
+        assert_eq!(read_at(&mut stream, 0, 10), data[..10]);
+        assert_eq!(read_at(&mut stream, 1000, 10), data[1000..1010]);
+        assert_eq!(opens.load(Ordering::Relaxed), 0);
+
+        // across the end of the head
+        let start = HEAD_SIZE - 10;
+        assert_eq!(
+            read_at(&mut stream, start as u64, 20),
+            data[start..start + 20]
+        );
+        assert_eq!(opens.load(Ordering::Relaxed), 1);
+    }
+
+    #[test]
+    fn seek() {
+        let data = make_file(HEAD_SIZE * 4);
+        let (mut stream, opens) = make_stream(data.clone());
+
+        let far = HEAD_SIZE * 3;
+        assert_eq!(read_at(&mut stream, far as u64, 100), data[far..far + 100]);
+        assert_eq!(opens.load(Ordering::Relaxed), 1);
+
+        // forward keeps the reader
+        let further = far + 1000;
+        assert_eq!(
+            read_at(&mut stream, further as u64, 100),
+            data[further..further + 100]
+        );
+        assert_eq!(opens.load(Ordering::Relaxed), 1);
+
+        // backward into the head doesn't need the reader
+        assert_eq!(read_at(&mut stream, 10, 10), data[10..20]);
+        assert_eq!(opens.load(Ordering::Relaxed), 1);
+
+        // backward past the head re-opens the file
+        let back = HEAD_SIZE + 10;
+        assert_eq!(
+            read_at(&mut stream, back as u64, 100),
+            data[back..back + 100]
+        );
+        assert_eq!(opens.load(Ordering::Relaxed), 2);
+    }
+
+    #[test]
+    fn read_at_end() {
+        let data = make_file(HEAD_SIZE * 2);
+        let (mut stream, opens) = make_stream(data.clone());
+
+        let start = data.len() - 10;
+        assert_eq!(read_at(&mut stream, start as u64, 100), data[start..]);
+        assert!(read_at(&mut stream, data.len() as u64, 100).is_empty());
+        assert!(read_at(&mut stream, data.len() as u64 + 1000, 100).is_empty());
+        assert_eq!(opens.load(Ordering::Relaxed), 1);
+
+        // small file is never opened again
+        let data = make_file(100);
+        let (mut stream, opens) = make_stream(data.clone());
+        assert_eq!(read_at(&mut stream, 0, 1000), data);
+        assert!(read_at(&mut stream, 100, 1000).is_empty());
+        assert_eq!(opens.load(Ordering::Relaxed), 0);
+    }
+}
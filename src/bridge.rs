@@ -15,9 +15,86 @@ pub mod bridge {
         z: f32,
     }
 
+    enum OutputType {
+        /// Autodetect
+        Default,
+        /// No audio output, mixing happens in realtime
+        NoSound,
+        /// No audio output, mixing happens on each `update` as fast as possible
+        NoSoundNrt,
+        /// Same as `NoSoundNrt`, but output is written to a WAV file
+        /// (see `InitParams::output_file`)
+        WavWriterNrt,
+        /// Windows
+        Wasapi,
+        /// Windows, low latency. Requires ASIO driver
+        Asio,
+        /// Linux
+        PulseAudio,
+        /// Linux, low latency
+        Alsa,
+        /// MacOS and iOS
+        CoreAudio,
+    }
+
+    enum SpeakerMode {
+        /// Same as output device
+        Default,
+        Mono,
+        Stereo,
+        /// 4.0
+        Quad,
+        /// 5.0
+        Surround,
+        /// 5.1
+        Surround51,
+        /// 7.1
+        Surround71,
+    }
+
+    /// Where FMOD allocates memory from
+    enum MemoryMode {
+        /// System heap
+        System,
+        /// Fixed pool of `memory_size` bytes (rounded down to multiple of 512).
+        /// FMOD fails to allocate when it's exhausted.
+        Pool,
+        /// Thread-safe pool allocator which takes at most `memory_size` bytes
+        /// from system heap (unlimited if zero). Small blocks are reused
+        /// instead of being returned to the heap.
+        Allocator,
+    }
+
     struct InitParams {
         max_virtual_channels: i32,
         max_active_channels: i32,
+        output_type: OutputType,
+        /// If positive, FMOD is updated by separate thread at this rate (times
+        /// per second), and `update` does nothing.
+        update_thread_rate: f32,
+        /// Max number of compressed samples (see `LoadMode`) playing at once, per format.
+        /// If zero, FMOD default is used.
+        max_codecs: i32,
+
+        // Mixer settings. Latency is `dsp_buffer_length * dsp_buffer_count / sample_rate`;
+        // lower values use more CPU and may cause stuttering. If zero, FMOD defaults are used
+        // (1024 samples, 4 buffers, 48 kHz).
+        /// Samples per mix block
+        dsp_buffer_length: u32,
+        dsp_buffer_count: i32,
+        sample_rate: i32,
+        speaker_mode: SpeakerMode,
+
+        /// Allows FMOD Profiler to connect over network
+        enable_profiler: bool,
+
+        /// Can only be set once per process, before first bridge is created
+        memory_mode: MemoryMode,
+        memory_size: u32,
+
+        /// File written by `WavWriterNrt` output. If empty, it's `fmodoutput.wav`
+        /// in working directory
+        output_file: String,
     }
 
     struct EngineParams {
@@ -25,11 +102,64 @@ pub mod bridge {
         distance_scale: f32,
         rolloff_scale: f32,
         max_world_size: f32,
+        /// Only this number of reverb spheres nearest to the listener are applied
+        max_active_reverbs: u32,
+        /// Sounds with linear volume below this become virtual (aren't mixed),
+        /// and non-looped ones aren't played at all
+        virtual_volume: f32,
+        /// Position and velocity updates which change both by less than this
+        /// are not sent to FMOD
+        spatial_epsilon: f32,
+        /// Sounds beyond their max distance from the listener are updated
+        /// only on every N-th update. 0 and 1 mean every update
+        far_update_interval: u32,
+        /// Volume of the master group, applied to all sounds
+        master_volume: f32,
     }
 
     struct GroupParams {
+        /// In range `[0; 4096)`
         user_id: i32,
         volume: f32,
+        /// Max number of sounds playing in the group at once, including
+        /// virtual ones; new sounds are not played if limit is reached.
+        /// Zero means no limit.
+        max_instances: u32,
+        /// Non-looped sounds quieter than this aren't played. It's used only
+        /// if higher than `EngineParams::virtual_volume`.
+        virtual_volume: f32,
+        /// Group whose volume also applies to this one, or -1 if none.
+        /// Parent is created if it doesn't exist.
+        parent_id: i32,
+
+        // Effects applied to the group mix
+        /// Lowpass filter cutoff frequency, Hz. Zero disables the filter
+        lowpass_cutoff: f32,
+        /// Compressor is enabled only if ratio is more than 1
+        compressor_ratio: f32,
+        /// dB
+        compressor_threshold: f32,
+        /// Milliseconds
+        compressor_attack: f32,
+        /// Milliseconds
+        compressor_release: f32,
+        /// If not -1, compressor is driven by output of this group instead of
+        /// the own one (i.e. music is ducked by dialogue). Group is created if
+        /// it doesn't exist.
+        sidechain_group_id: i32,
+    }
+
+    /// How sound data is kept in memory
+    enum LoadMode {
+        /// `Stream` for `filename` and `file_buffer`, `Sample` for `file_contents`
+        Default,
+        /// Fully decoded into PCM. Fast playback, but uses the most memory
+        Sample,
+        /// Kept compressed and decoded during playback
+        CompressedSample,
+        /// Read and decoded in small chunks during playback.
+        /// Such sound can be played only once at a time.
+        Stream,
     }
 
     #[derive(Default)]
@@ -37,13 +167,37 @@ pub mod bridge {
         /// Path to the file, full or relative to current directory.
         /// This loads file as streaming.
         ///
-        /// If defaulted, `file_contents` is used.
+        /// If defaulted, `file_buffer` is used.
         filename: String,
 
-        /// File fully loaded into memory.
+        /// File fully loaded into memory, ownership is passed to the engine.
+        /// This streams file from the buffer without copying it.
         ///
-        /// If defaulted, `custom` is used.
+        /// If defaulted, `file_contents` is used.
+        file_buffer: Vec<u8>,
+
+        /// File fully loaded into memory, it is copied by the engine.
         file_contents: &'a [u8],
+
+        mode: LoadMode,
+
+        /// Size of file read buffer for streams, in bytes.
+        /// If zero, FMOD default is used.
+        stream_buffer_size: u32,
+
+        /// Load sound in background thread, see `poll_load_state`.
+        /// Ignored for `file_contents`.
+        non_blocking: bool,
+
+        /// `filename` is opened and read by `bridge_file_*` functions instead
+        /// of FMOD. Should be used with `non_blocking`, since opening may block.
+        use_file_callbacks: bool,
+    }
+
+    enum LoadState {
+        Loading,
+        Ready,
+        Error,
     }
 
     struct ChannelParams {
@@ -72,8 +226,24 @@ pub mod bridge {
         /// Speed at which to play (this IS playback speed, not pitch!)
         pitch: f32,
 
-        /// Pause before actually starting playback, microseconds
+        /// Pause before actually starting playback, microseconds.
+        /// Relative to the clock cached by `begin_frame_clock`.
         startup_delay: i32,
+        /// If not zero, absolute mixer clock at which to start playback (see `FrameClock`);
+        /// `startup_delay` is ignored then. Sound starts immediately if it's in the past.
+        start_clock: u64,
+        /// Sound isn't played if the same sound was played less than this ago, microseconds
+        cooldown: i32,
+    }
+
+    /// Defaults of channels playing the sound, see `add_sound_template`.
+    /// Same fields as in `ChannelParams`.
+    struct SoundTemplate {
+        is_positional: bool,
+        min_distance: f32,
+        max_distance: f32,
+        looped: bool,
+        priority: i32,
     }
 
     #[derive(Default)]
@@ -92,6 +262,13 @@ pub mod bridge {
         priority: i32,
     }
 
+    /// Entry for `update_channels_batch`
+    struct ChannelBatchEntry {
+        /// ID of the channel
+        id: i32,
+        params: ChannelUpdateParams,
+    }
+
     #[derive(Clone, Default)]
     struct ListenerParams {
         // World vectors for listener
@@ -113,6 +290,40 @@ pub mod bridge {
         polygons: Vec<Polygon>,
     }
 
+    /// Same as `Geometry`, but vertices of all polygons are in a single array
+    struct FlatGeometry<'a> {
+        direct_occlusion: f32,
+        reverb_occlusion: f32,
+        /// Vertices of all polygons, one polygon after another
+        vertices: &'a [Vector],
+        /// Number of vertices in each polygon, at least 3
+        polygon_sizes: &'a [u32],
+    }
+
+    /// Transform of geometry. Polygons are specified relative to it
+    #[derive(Clone, Copy)]
+    struct GeometryTransform {
+        position: Vector,
+        /// Direction of local +Z axis
+        forward: Vector,
+        /// Direction of local +Y axis
+        up: Vector,
+        scale: Vector,
+    }
+
+    /// Level of detail of geometry (see `set_geometry_lod`).
+    /// Distance is measured from the listener to the bounding sphere of the geometry.
+    #[derive(Clone, Copy)]
+    struct GeometryLod {
+        /// Instance of this prototype is used instead of the geometry at `proxy_distance`
+        /// and farther. If -1, geometry is always used.
+        proxy_prototype_id: i32,
+        proxy_distance: f32,
+        /// Neither geometry nor proxy are used at this distance and farther.
+        /// If zero, geometry is never disabled.
+        cull_distance: f32,
+    }
+
     #[derive(Clone)]
     struct Reverb {
         min_dist: f32,
@@ -134,10 +345,67 @@ pub mod bridge {
         wet_level: f32,
     }
 
+    /// Mixer clock, see `begin_frame_clock`
+    #[derive(Clone, Copy, Default)]
+    struct FrameClock {
+        /// In samples
+        clock: u64,
+        /// Clock ticks per second
+        sample_rate: i32,
+    }
+
+    /// Call statistics of a bridge method, totals since the bridge was created
+    #[derive(Clone, Default)]
+    struct MethodStats {
+        name: String,
+        calls: u64,
+        total_ns: u64,
+    }
+
+    /// See `get_stats`
+    #[derive(Clone, Default)]
+    struct BridgeStats {
+        /// CPU usage of FMOD threads, in percent
+        cpu_dsp: f32,
+        cpu_stream: f32,
+        cpu_geometry: f32,
+        cpu_update: f32,
+
+        /// Including virtual ones
+        channels_playing: i32,
+        channels_real: i32,
+
+        /// Memory allocated by FMOD, in bytes
+        memory_current: i64,
+        memory_max: i64,
+
+        /// Bytes read from files since the start
+        sample_bytes_read: i64,
+        stream_bytes_read: i64,
+        other_bytes_read: i64,
+
+        methods: Vec<MethodStats>,
+    }
+
     // Rust methods visible in C++
     extern "Rust" {
         fn bridge_log_info(s: &[u8]);
         fn bridge_log_error(s: &[u8]);
+
+        // Profiler zones, called only if built with `profile` feature.
+        // Zones are strictly nested on each thread.
+        fn bridge_zone_begin(name: &str);
+        fn bridge_zone_end();
+
+        // File access for `AudioFileParams::use_file_callbacks`, called from FMOD threads.
+        // Reads are asynchronous: each request is completed later with `file_read_done`.
+        fn bridge_file_open(name: &str, file_size: &mut u32) -> u64; // returns 0 on error
+        fn bridge_file_close(handle: u64); // called after all reads are completed
+        fn bridge_file_read_async(handle: u64, request: usize, offset: u32, size: u32);
+
+        // Called from FMOD thread when any non-blocking load finishes (see `load_state`).
+        // May also be called spuriously.
+        fn bridge_sound_loaded();
     }
 
     // Interface class.
@@ -147,30 +415,72 @@ pub mod bridge {
 
         type Bridge;
 
-        // IDs can be same between object types, and are reused after being freed.
+        // IDs can be same between object types. Slots are reused after being freed,
+        // but IDs include generation counter, so stale IDs are not.
         //
         // All errors are logged; methods that return IDs will return -1 on failure.
         //
-        // Some methods will crash the application if used incorrectly (i.e. using
-        // invalid ID), but should never do it in any other situtation.
+        // Using invalid or stale ID is logged as error and otherwise ignored.
+        //
+        // Methods taking `&Bridge` can be called from multiple threads at once.
 
         fn create(params: InitParams) -> UniquePtr<Bridge>;
+
+        /// Completes `bridge_file_read_async`; less data than requested means end of file.
+        /// # Safety
+        /// `request` must be the one passed there, and each is completed exactly once.
+        unsafe fn file_read_done(request: usize, data: &[u8], ok: bool);
+
         fn update(self: Pin<&mut Bridge>); // must be called periodically
         fn update_engine(self: Pin<&mut Bridge>, params: EngineParams);
+        /// Only for non-realtime output: updates until at least `samples` are mixed,
+        /// returns number of samples mixed
+        fn render(self: Pin<&mut Bridge>, samples: u32) -> u64;
 
         fn update_listener(self: Pin<&mut Bridge>, params: ListenerParams);
+        fn queue_listener_update(self: &Bridge, params: ListenerParams); // applied in `update` or before it's needed; latest wins
+        /// Sets all listeners at once (up to 8). Sounds are heard by the nearest one.
+        /// Empty slice is ignored.
+        fn update_listeners(self: Pin<&mut Bridge>, listeners: &[ListenerParams]);
+        fn queue_listener_updates(self: &Bridge, listeners: &[ListenerParams]); // same as queue_listener_update
         fn update_group(self: Pin<&mut Bridge>, params: GroupParams);
+        fn begin_frame_clock(self: Pin<&mut Bridge>) -> FrameClock; // call once per frame
+        fn get_stats(self: Pin<&mut Bridge>) -> BridgeStats;
 
         fn load_audio_file(self: Pin<&mut Bridge>, params: AudioFileParams) -> i32; // returns -1 on error
+        fn poll_load_state(self: Pin<&mut Bridge>, id: i32) -> LoadState;
+        fn load_state(self: &Bridge, id: i32) -> LoadState; // same, but doesn't free load buffer
+        fn add_sound_template(self: Pin<&mut Bridge>, sound_id: i32, params: SoundTemplate) -> i32; // only speeds up play_channel; returns -1 on error
+        fn set_sound_template(self: Pin<&mut Bridge>, id: i32, params: SoundTemplate);
+        fn free_sound_template(self: Pin<&mut Bridge>, id: i32);
         fn free_audio_file(self: Pin<&mut Bridge>, id: i32);
 
-        fn play_channel(self: Pin<&mut Bridge>, params: ChannelParams) -> i32; // returns -1 on error
+        fn play_channel(self: Pin<&mut Bridge>, params: ChannelParams) -> i32; // returns -1 on error, -3 if rejected by voice budget
+        fn play_channels_batch(self: Pin<&mut Bridge>, entries: &[ChannelParams]) -> Vec<i32>; // same as play_channel for each
         fn update_channel(self: Pin<&mut Bridge>, id: i32, params: ChannelUpdateParams) -> bool;
+        fn update_channels_batch(self: Pin<&mut Bridge>, entries: &[ChannelBatchEntry])
+            -> Vec<u64>; // bitset of playing sounds
+        fn queue_channel_updates(self: &Bridge, entries: &[ChannelBatchEntry]) -> usize; // returns number queued
         fn is_playing_channel(self: Pin<&mut Bridge>, id: i32) -> bool; // sound haven't stopped yet
+        fn collect_finished_channels(self: Pin<&mut Bridge>) -> Vec<i32>; // IDs which are already freed
         fn free_channel(self: Pin<&mut Bridge>, id: i32);
 
         fn add_geometry(self: Pin<&mut Bridge>, params: Geometry) -> i32; // returns -1 on error
+        fn add_geometry_flat(self: Pin<&mut Bridge>, params: FlatGeometry) -> i32; // returns -1 on error
         fn free_geometry(self: Pin<&mut Bridge>, id: i32);
+        fn update_geometry_transform(self: Pin<&mut Bridge>, id: i32, transform: GeometryTransform);
+
+        // Polygons are uploaded once, instances are freed with `free_geometry`
+        fn add_geometry_prototype(self: Pin<&mut Bridge>, params: FlatGeometry) -> i32; // returns -1 on error
+        fn free_geometry_prototype(self: Pin<&mut Bridge>, id: i32); // existing instances are kept
+        fn bake_geometry(self: Pin<&mut Bridge>, params: FlatGeometry) -> Vec<u8>; // returns empty on error
+        fn load_geometry_prototype(self: Pin<&mut Bridge>, data: &[u8]) -> i32; // returns -1 on error
+        fn add_geometry_instance(
+            self: Pin<&mut Bridge>,
+            prototype_id: i32,
+            transform: GeometryTransform,
+        ) -> i32; // returns -1 on error
+        fn set_geometry_lod(self: Pin<&mut Bridge>, id: i32, params: GeometryLod);
 
         fn add_reverb(self: Pin<&mut Bridge>, params: Reverb) -> i32; // returns -1 on error
         fn free_reverb(self: Pin<&mut Bridge>, id: i32);
@@ -189,6 +499,42 @@ fn bridge_log_error(s: &[u8]) {
     bevy::log::error!("{}", String::from_utf8_lossy(s));
 }
 
+thread_local! {
+    static PROFILER_ZONES: std::cell::RefCell<Vec<bevy::utils::tracing::span::EnteredSpan>> =
+        Default::default();
+}
+
+fn bridge_zone_begin(name: &str) {
+    let span = bevy::utils::tracing::info_span!("fmod_bridge", name).entered();
+    PROFILER_ZONES.with(|zones| zones.borrow_mut().push(span));
+}
+
+fn bridge_zone_end() {
+    PROFILER_ZONES.with(|zones| zones.borrow_mut().pop());
+}
+
+fn bridge_file_open(name: &str, file_size: &mut u32) -> u64 {
+    crate::asset_stream::open(name, file_size)
+}
+
+fn bridge_file_close(handle: u64) {
+    crate::asset_stream::close(handle)
+}
+
+fn bridge_file_read_async(handle: u64, request: usize, offset: u32, size: u32) {
+    crate::asset_stream::read_async(handle, request, offset, size)
+}
+
+fn bridge_sound_loaded() {
+    crate::plugin::notify_sound_loaded()
+}
+
+impl Default for bridge::LoadMode {
+    fn default() -> Self {
+        Self::Default
+    }
+}
+
 impl From<bevy::prelude::Vec3> for bridge::Vector {
     fn from(v: bevy::prelude::Vec3) -> Self {
         Self {
@@ -198,3 +544,63 @@ impl From<bevy::prelude::Vec3> for bridge::Vector {
         }
     }
 }
+
+impl From<&bevy::prelude::GlobalTransform> for bridge::GeometryTransform {
+    fn from(transform: &bevy::prelude::GlobalTransform) -> Self {
+        let (scale, rotation, translation) = transform.to_scale_rotation_translation();
+        Self {
+            position: translation.into(),
+            forward: (rotation * bevy::prelude::Vec3::Z).into(),
+            up: (rotation * bevy::prelude::Vec3::Y).into(),
+            scale: scale.into(),
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::bridge::{GeometryTransform, Vector};
+    use bevy::prelude::{GlobalTransform, Quat, Transform, Vec3};
+    use std::f32::consts::FRAC_PI_2;
+
+    fn to_vec3(v: &Vector) -> Vec3 {
+        Vec3::new(v.x, v.y, v.z)
+    }
+
+    fn convert(transform: Transform) -> GeometryTransform {
+        (&GlobalTransform::from(transform)).into()
+    }
+
+    #[test]
+    fn geometry_transform_identity() {
+        let geometry = convert(Transform::IDENTITY);
+        assert!(to_vec3(&geometry.position).abs_diff_eq(Vec3::ZERO, 1e-5));
+        assert!(to_vec3(&geometry.forward).abs_diff_eq(Vec3::Z, 1e-5));
+        assert!(to_vec3(&geometry.up).abs_diff_eq(Vec3::Y, 1e-5));
+        assert!(to_vec3(&geometry.scale).abs_diff_eq(Vec3::ONE, 1e-5));
+    }
+
+    #[test]
+    fn geometry_transform_axes() {
+        let transform = Transform {
+            translation: Vec3::new(1., 2., 3.),
+            rotation: Quat::from_rotation_y(FRAC_PI_2),
+            scale: Vec3::new(2., 3., 4.),
+        };
+        let geometry = convert(transform);
+
+        // rotation around Y turns +Z towards +X and keeps +Y
+        assert!(to_vec3(&geometry.position).abs_diff_eq(Vec3::new(1., 2., 3.), 1e-5));
+        assert!(to_vec3(&geometry.forward).abs_diff_eq(Vec3::X, 1e-5));
+        assert!(to_vec3(&geometry.up).abs_diff_eq(Vec3::Y, 1e-5));
+        assert!(to_vec3(&geometry.scale).abs_diff_eq(Vec3::new(2., 3., 4.), 1e-5));
+    }
+
+    #[test]
+    fn geometry_transform_up_axis() {
+        // rotation around X turns +Y towards +Z, and +Z towards -Y
+        let geometry = convert(Transform::from_rotation(Quat::from_rotation_x(FRAC_PI_2)));
+        assert!(to_vec3(&geometry.forward).abs_diff_eq(Vec3::NEG_Y, 1e-5));
+        assert!(to_vec3(&geometry.up).abs_diff_eq(Vec3::Z, 1e-5));
+    }
+}
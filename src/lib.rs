@@ -5,17 +5,27 @@
 //! - playback control: volume and speed;
 //! - 3D spatial audio:
 //!     - distance falloff and Doppler effect;
-//!     - occlusion by geometry;
+//!     - occlusion by geometry, with instancing and level of detail;
 //!     - reverb effect;
-//! - support for most common audio file formats;
-//! - sound groups and global settings.
+//!     - multiple listeners for split-screen;
+//! - support for most common audio file formats, streaming from any asset
+//!   source;
+//! - sound groups (which can be nested, with lowpass and ducking effects) and
+//!   global settings;
+//! - engine statistics as bevy diagnostics (see [`AudioDiagnosticsPlugin`]);
+//! - non-realtime output, for deterministic tests and rendering audio to file.
 //!
 //! Missing features:
-//! - per-group DSP;
 //! - support for procedurally-generated sounds;
 //! - loop start and end points for looped sounds.
 
+#[cfg(not(feature = "bench"))]
 mod bridge;
+#[cfg(feature = "bench")]
+#[doc(hidden)]
+pub mod bridge; // used directly by bench example
+
+mod asset_stream;
 mod plugin;
 
 pub use plugin::*;
@@ -1,12 +1,20 @@
 use super::bridge::bridge;
 use bevy::{
-    asset::AsyncReadExt as _,
+    asset::{AssetPath, AsyncReadExt as _},
+    diagnostic::{Diagnostic, DiagnosticPath, Diagnostics, RegisterDiagnostic},
     prelude::*,
     reflect::TypePath,
     transform::TransformSystem,
     utils::{HashMap, HashSet},
 };
-use std::{sync::Mutex, time::Duration};
+use std::{
+    sync::{
+        atomic::{AtomicI32, AtomicU64, Ordering},
+        Mutex, RwLock,
+    },
+    task::{Poll, Waker},
+    time::Duration,
+};
 
 #[cfg(feature = "randomize")]
 use rand::prelude::*;
@@ -23,6 +31,11 @@ use rand::prelude::*;
 ///
 /// When playback stops, the entity will be despawned. Vice-versa, removing
 /// [`Handle<AudioSource>`] stops playback.
+///
+/// Non-looped sounds which wouldn't be audible (i.e. too far from the
+/// listener), or exceed [`AudioGroupParameters::max_instances`] or
+/// [`AudioSource::cooldown`], are not played at all and are despawned
+/// immediately.
 #[derive(Asset, TypePath)]
 pub struct AudioSource {
     id: EngineId,
@@ -35,16 +48,42 @@ pub struct AudioSource {
     /// Randomize default parameters on each use
     #[cfg(feature = "randomize")]
     pub randomize_params: bool,
+
+    /// Source isn't played if it was already played less than this time ago.
+    ///
+    /// _Prevents the same sound from stacking when many events trigger it at
+    /// once, i.e. impacts of a shotgun blast._
+    pub cooldown: Duration,
+
+    /// Whether the source is usually played as spatial (with
+    /// [`GlobalTransform`]).
+    ///
+    /// Only a hint: engine is set up to play the source this way with fewer
+    /// calls. Same for `looped` and for distances and priority in `params`.
+    pub is_positional: bool,
+
+    /// Whether the source is usually played with [`AudioLoop`], see
+    /// `is_positional`.
+    pub looped: bool,
+
+    /// Engine template made from the hints, -1 until it's created
+    template_id: AtomicI32,
+
+    /// Keeps size and beginning of a streamed asset while it can be opened
+    stream_file: Option<crate::asset_stream::ScannedFile>,
 }
 
 impl AudioSource {
     /// Load source from file loaded into memory.
     ///
+    /// If exactly the same file contents were already loaded, decoded sound is
+    /// shared instead of being loaded again.
+    ///
     /// Returns [`None`] on error.
     ///
     /// This is how sounds are loaded via [`AssetServer`].
     pub fn from_memory(file_contents: &[u8]) -> Option<Self> {
-        let mut bridge = BRIDGE.lock().unwrap();
+        let mut bridge = BRIDGE.write().unwrap();
         let bridge = bridge.as_mut().unwrap().pin_mut();
         let instance = bridge.load_audio_file(bridge::AudioFileParams {
             file_contents,
@@ -53,6 +92,77 @@ impl AudioSource {
         (instance != -1).then_some(Self::new(instance))
     }
 
+    /// Load source from file loaded into memory, using specified mode.
+    ///
+    /// Buffer is passed to the engine, which keeps it only if needed by the
+    /// mode (or until loading is finished).
+    ///
+    /// **This doesn't block** - file is decoded in background thread. Sound
+    /// can't be played until [`AudioSource::load_state`] is
+    /// [`AudioLoadState::Ready`]; asset loader waits for that.
+    ///
+    /// Returns [`None`] on error.
+    pub fn from_memory_with(
+        file_contents: Vec<u8>,
+        settings: &AudioLoaderSettings,
+    ) -> Option<Self> {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+        let instance = bridge.load_audio_file(bridge::AudioFileParams {
+            file_buffer: file_contents,
+            mode: settings.mode.into(),
+            stream_buffer_size: settings.stream_buffer_size,
+            non_blocking: true,
+            ..default()
+        });
+        (instance != -1).then_some(Self::new(instance))
+    }
+
+    /// Sources loaded via [`AssetServer`] are always ready: loader waits
+    /// (without occupying a thread) until the engine reports that loading is
+    /// finished.
+    ///
+    /// Needs only a read lock on the engine, but it's still better not to call
+    /// this in a loop.
+    pub fn load_state(&self) -> AudioLoadState {
+        let bridge = BRIDGE.read().unwrap();
+        match bridge.as_ref().unwrap().load_state(self.id) {
+            bridge::LoadState::Loading => AudioLoadState::Loading,
+            bridge::LoadState::Ready => AudioLoadState::Ready,
+            _ => AudioLoadState::Failed,
+        }
+    }
+
+    /// Completes when sound is loaded, without polling in between
+    async fn wait_until_loaded(&self) -> AudioLoadState {
+        loop {
+            let seen = LOAD_EVENTS.load(Ordering::Acquire); // before the check, so event isn't missed
+            match self.load_state() {
+                AudioLoadState::Loading => wait_for_load_event(seen).await,
+                state => break state,
+            }
+        }
+    }
+
+    /// Stream file from memory as it is being played instead of decoding it
+    /// whole first. Buffer is used by the engine as is, without copying.
+    ///
+    /// _This is useful for long ambience or music, which would take a lot of
+    /// memory uncompressed._
+    ///
+    /// **Only one such source can be played back at once!**
+    ///
+    /// Returns [`None`] on error.
+    pub fn stream_memory(file_contents: Vec<u8>) -> Option<Self> {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+        let instance = bridge.load_audio_file(bridge::AudioFileParams {
+            file_buffer: file_contents,
+            ..default()
+        });
+        (instance != -1).then_some(Self::new(instance))
+    }
+
     /// Stream file from disk as it is being played instead of loading it whole
     /// into memory first.
     ///
@@ -66,7 +176,7 @@ impl AudioSource {
     ///
     /// Returns [`None`] on error.
     pub fn stream_file(filename: String) -> Option<Self> {
-        let mut bridge = BRIDGE.lock().unwrap();
+        let mut bridge = BRIDGE.write().unwrap();
         let bridge = bridge.as_mut().unwrap().pin_mut();
         let instance = bridge.load_audio_file(bridge::AudioFileParams {
             filename,
@@ -75,6 +185,33 @@ impl AudioSource {
         (instance != -1).then_some(Self::new(instance))
     }
 
+    /// Stream asset as it is being played, reading it through its asset source
+    /// (so it works with packed archives and other custom sources).
+    ///
+    /// **This doesn't block**, see [`AudioSource::load_state`]. When opened,
+    /// file is read once to find its size, unless it was loaded via
+    /// [`AssetServer`] (which does this in its loader) or is already open.
+    ///
+    /// **Only one such source can be played back at once!**
+    ///
+    /// Returns [`None`] on error.
+    pub fn stream_asset(
+        path: impl Into<AssetPath<'static>>,
+        stream_buffer_size: u32,
+    ) -> Option<Self> {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+        let instance = bridge.load_audio_file(bridge::AudioFileParams {
+            filename: path.into().to_string(),
+            mode: bridge::LoadMode::Stream,
+            stream_buffer_size,
+            non_blocking: true,
+            use_file_callbacks: true,
+            ..default()
+        });
+        (instance != -1).then_some(Self::new(instance))
+    }
+
     fn new(id: EngineId) -> Self {
         Self {
             id,
@@ -82,6 +219,12 @@ impl AudioSource {
 
             #[cfg(feature = "randomize")]
             randomize_params: false,
+
+            cooldown: Duration::ZERO,
+            is_positional: true,
+            looped: false,
+            template_id: AtomicI32::new(-1),
+            stream_file: None,
         }
     }
 
@@ -104,12 +247,76 @@ impl AudioSource {
 
 impl Drop for AudioSource {
     fn drop(&mut self) {
-        let mut bridge = BRIDGE.lock().unwrap();
-        let bridge = bridge.as_mut().unwrap().pin_mut();
+        let mut bridge = BRIDGE.write().unwrap();
+        let mut bridge = bridge.as_mut().unwrap().pin_mut();
+        let template_id = *self.template_id.get_mut();
+        if template_id != -1 {
+            bridge.as_mut().free_sound_template(template_id);
+        }
         bridge.free_audio_file(self.id);
     }
 }
 
+/// How [`AudioSource`] data is kept in memory
+#[derive(Clone, Copy, Default, PartialEq, Eq, Debug, serde::Serialize, serde::Deserialize)]
+pub enum AudioLoadMode {
+    /// Fully decoded when loaded. Fastest playback, but uses the most memory.
+    ///
+    /// _Best for short and frequently played sounds._
+    #[default]
+    Sample,
+
+    /// Kept compressed in memory and decoded during playback.
+    ///
+    /// Only some formats (i.e. MP3) support this, others are fully decoded
+    /// instead.
+    CompressedSample,
+
+    /// Decoded in small chunks during playback.
+    ///
+    /// **Only one such source can be played back at once!**
+    ///
+    /// _Best for music and long ambience._
+    Stream,
+}
+
+impl From<AudioLoadMode> for bridge::LoadMode {
+    fn from(mode: AudioLoadMode) -> Self {
+        match mode {
+            AudioLoadMode::Sample => Self::Sample,
+            AudioLoadMode::CompressedSample => Self::CompressedSample,
+            AudioLoadMode::Stream => Self::Stream,
+        }
+    }
+}
+
+/// See [`AudioSource::load_state`]
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum AudioLoadState {
+    Loading,
+    Ready,
+    Failed,
+}
+
+/// Settings used by [`AssetServer`] to load [`AudioSource`].
+///
+/// Use [`AssetServer::load_with_settings`] to change them.
+#[derive(Clone, Default, Debug, serde::Serialize, serde::Deserialize)]
+#[serde(default)]
+pub struct AudioLoaderSettings {
+    pub mode: AudioLoadMode,
+
+    /// Size of file read buffer for [`AudioLoadMode::Stream`], in bytes.
+    ///
+    /// If zero, engine default is used.
+    pub stream_buffer_size: u32,
+
+    /// For [`AudioLoadMode::Stream`]: don't load the whole file, read it from
+    /// the asset source during playback instead. See
+    /// [`AudioSource::stream_asset`].
+    pub stream_from_source: bool,
+}
+
 /// Add together with [`Handle<AudioSource>`] to play sound on repeat forever.
 ///
 /// Otherwise this component is ignored.
@@ -186,6 +393,9 @@ impl AudioParameters {
 
 /// Add together with [`Handle<AudioSource>`] to start playback after specified
 /// delay.
+///
+/// Delay is counted from [`AudioClock`] of the current frame, so sounds with
+/// the same delay spawned in the same frame start exactly at the same time.
 #[derive(Component, Clone, Default)]
 pub struct AudioStartupDelay(pub Duration);
 
@@ -206,6 +416,44 @@ impl AudioStartupDelay {
     }
 }
 
+/// Add together with [`Handle<AudioSource>`] to start playback at specified
+/// mixer clock, see [`AudioClock::after`]. Overrides [`AudioStartupDelay`].
+///
+/// Use it to line up sounds which are spawned in different frames.
+#[derive(Component, Clone, Copy, Default, PartialEq, Eq, PartialOrd, Ord, Debug)]
+pub struct AudioStartTime(pub u64);
+
+/// Mixer clock at the end of the previous frame, updated once per frame.
+#[derive(Resource, Clone, Copy, Default, Debug)]
+pub struct AudioClock {
+    /// Samples played since the engine started
+    pub clock: u64,
+    /// Clock ticks per second
+    pub sample_rate: u32,
+}
+
+impl AudioClock {
+    /// Start time which is `delay` after this clock
+    pub fn after(&self, delay: Duration) -> AudioStartTime {
+        let ticks = delay.as_secs_f64() * self.sample_rate as f64;
+        AudioStartTime(self.clock + ticks as u64)
+    }
+
+    /// Time elapsed since the engine started
+    pub fn elapsed(&self) -> Duration {
+        Duration::from_secs_f64(self.clock as f64 / self.sample_rate.max(1) as f64)
+    }
+}
+
+impl From<bridge::FrameClock> for AudioClock {
+    fn from(clock: bridge::FrameClock) -> Self {
+        Self {
+            clock: clock.clock,
+            sample_rate: clock.sample_rate.max(0) as u32,
+        }
+    }
+}
+
 /// Add together with [`Handle<AudioSource>`] to assign sound to a non-default
 /// group.
 ///
@@ -214,9 +462,10 @@ impl AudioStartupDelay {
 /// Each sound is assigned to a group, for easier manipulation.
 /// Groups are defined by user (except for default group `AudioGroup(0)`)
 ///
-/// Groups are not required to be registered in any way.
-/// ATM they are used only for per-group settings, but there are plans for
-/// per-group effect plugins and combining several groups.
+/// Groups are not required to be registered in any way. ID must be in
+/// `[0; 4096)` range, otherwise default group is used.
+///
+/// Groups can be nested, see [`AudioGroupParameters::parent`].
 // TODO(later): dont' ignore changes
 #[derive(Component, Default, Clone, Copy, PartialEq, Eq, Hash, Debug)]
 #[cfg_attr(feature = "serialize", derive(serde::Serialize, serde::Deserialize))]
@@ -227,8 +476,12 @@ pub struct AudioGroup(pub i32);
 ///
 /// Otherwise this component is ignored.
 ///
-/// Requires [`GlobalTransform`]. Changes to it will be ignored.
-// TODO(later): dont' ignore changes
+/// Requires [`GlobalTransform`]. Vertices are relative to it, and geometry
+/// follows its changes.
+///
+/// _If many entities use the same geometry, use [`AudioGeometryPrototype`]
+/// instead._
+// TODO(later): dont' ignore changes of vertices
 #[derive(Component, Clone, Default)]
 #[cfg_attr(
     feature = "serialize",
@@ -272,12 +525,96 @@ impl Default for AudioGeometryParams {
     }
 }
 
+/// Audio geometry which is uploaded to the engine only once.
+///
+/// Add [`Handle<AudioGeometryPrototype>`] component to create an instance of
+/// it - that's much cheaper than [`AudioGeometry`] with the same polygons.
+/// Removal of the handle removes the instance from the engine. Instance is
+/// created once the asset is loaded.
+///
+/// Requires [`GlobalTransform`]. Vertices are relative to it, and instance
+/// follows its changes.
+///
+/// Existing instances are not affected when asset is removed.
+///
+/// Files with `.fmodgeom` extension, created with
+/// [`AudioGeometryPrototype::bake`], are loaded via [`AssetServer`] as this
+/// asset.
+#[derive(Asset, TypePath)]
+pub struct AudioGeometryPrototype {
+    id: EngineId,
+}
+
+impl AudioGeometryPrototype {
+    /// Returns [`None`] on error
+    pub fn new(geometry: &AudioGeometry) -> Option<Self> {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+        let id = geometry.with_flat(|geometry| bridge.add_geometry_prototype(geometry));
+        (id != -1).then_some(Self { id })
+    }
+
+    /// Converts geometry to engine binary format, which is loaded much faster
+    /// than polygons - so it can be done once when building the level.
+    ///
+    /// Returns [`None`] on error.
+    pub fn bake(geometry: &AudioGeometry) -> Option<Vec<u8>> {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+        let data = geometry.with_flat(|geometry| bridge.bake_geometry(geometry));
+        (!data.is_empty()).then_some(data)
+    }
+
+    /// Load prototype from result of [`AudioGeometryPrototype::bake`].
+    ///
+    /// Returns [`None`] on error.
+    pub fn from_baked(data: &[u8]) -> Option<Self> {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+        let id = bridge.load_geometry_prototype(data);
+        (id != -1).then_some(Self { id })
+    }
+}
+
+impl Drop for AudioGeometryPrototype {
+    fn drop(&mut self) {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+        bridge.free_geometry_prototype(self.id);
+    }
+}
+
+/// Add together with [`AudioGeometry`] or [`Handle<AudioGeometryPrototype>`]
+/// to replace or disable geometry depending on distance to the listener.
+/// Can be changed or removed at any time.
+///
+/// Distance is measured to the bounding sphere of the geometry.
+///
+/// _Occlusion is computed only for active geometry, so this keeps its cost low
+/// in large worlds._
+#[derive(Component, Clone, Default, Debug)]
+pub struct AudioGeometryLod {
+    /// Simplified geometry which is used instead at `proxy_distance` and
+    /// farther.
+    ///
+    /// **Must be already loaded!**
+    pub proxy: Option<Handle<AudioGeometryPrototype>>,
+    pub proxy_distance: f32,
+
+    /// If not zero, neither geometry nor proxy are used at this distance and
+    /// farther.
+    pub cull_distance: f32,
+}
+
 /// Add reverb sphere to the engine to affect spatial sounds.
 /// Removal of this component removes reverb from the engine.
 ///
 /// Otherwise this component is ignored.
 ///
 /// Requires [`GlobalTransform`]. Changes to it will be ignored.
+///
+/// Any number of spheres can exist, but only a few which affect the listener
+/// the most are applied, see [`AudioEngineSettings::max_active_reverbs`].
 // TODO(later): dont' ignore changes
 #[derive(Component, Debug)]
 #[cfg_attr(
@@ -446,13 +783,19 @@ impl AudioReverbProps {
 ///
 /// Requires [`GlobalTransform`].
 ///
-/// There can't be multiple listeners.
+/// There can be up to [`MAX_AUDIO_LISTENERS`] listeners (i.e. one per player
+/// in split-screen); each spatial sound is heard by the nearest one. Excess
+/// listeners are ignored. With multiple listeners engine doesn't apply doppler
+/// effect.
 ///
 /// If listener doesn't exist, spatial sounds will play at the last remembered
 /// position (which is `Vec3::ZERO` on startup).
 #[derive(Component, Clone, Default)]
 pub struct AudioListener;
 
+/// Max number of [`AudioListener`] entities used at once
+pub const MAX_AUDIO_LISTENERS: usize = 8;
+
 /// Global engine settings
 #[derive(Resource, Clone, Debug)]
 #[cfg_attr(
@@ -504,11 +847,81 @@ pub struct AudioGroupParameters {
     ///
     /// Should be in `[0; 1]` range.
     pub volume: f32,
+
+    /// Max number of sounds playing in the group at once. If limit is reached,
+    /// new sounds are not played.
+    pub max_instances: Option<usize>,
+
+    /// Non-looped sounds which would be quieter than this when started are not
+    /// played. Used only if higher than [`AudioEngineSettings::virtual_volume`].
+    pub virtual_volume: f32,
+
+    /// Volume of the parent group applies to this one too, so a category can
+    /// be muted or faded as a whole (i.e. "sfx" containing "weapons" and
+    /// "footsteps").
+    ///
+    /// Master volume applies only to groups without a parent. Cycles are not
+    /// allowed.
+    pub parent: Option<AudioGroup>,
+
+    /// Cutoff frequency (Hz) of lowpass filter applied to the group, i.e. to
+    /// muffle everything except UI while game is paused.
+    pub lowpass: Option<f32>,
+
+    pub compressor: Option<AudioCompressor>,
+}
+
+/// Compressor effect of a group, see [`AudioGroupParameters::compressor`].
+///
+/// Reduces volume of the group when its (or sidechain) level is above
+/// threshold. It's applied by the mixer, so it's not affected by frame rate.
+#[derive(Clone, Debug)]
+#[cfg_attr(
+    feature = "serialize",
+    derive(serde::Serialize, serde::Deserialize),
+    serde(default)
+)]
+pub struct AudioCompressor {
+    /// Level in dB above which volume is reduced, `[-60; 0]`
+    pub threshold: f32,
+
+    /// How much volume is reduced above threshold, `[1; 50]`
+    pub ratio: f32,
+
+    /// How fast volume is reduced, `[0.1; 500]` ms
+    pub attack: Duration,
+
+    /// How fast volume is restored, `[10; 5000]` ms
+    pub release: Duration,
+
+    /// If set, level of this group is used instead of the own one.
+    ///
+    /// _This is how music or ambience is ducked under dialogue._
+    pub sidechain: Option<AudioGroup>,
+}
+
+impl Default for AudioCompressor {
+    fn default() -> Self {
+        Self {
+            threshold: 0.,
+            ratio: 2.5,
+            attack: Duration::from_millis(20),
+            release: Duration::from_millis(100),
+            sidechain: None,
+        }
+    }
 }
 
 impl Default for AudioGroupParameters {
     fn default() -> Self {
-        Self { volume: 1. }
+        Self {
+            volume: 1.,
+            max_instances: None,
+            virtual_volume: 0.,
+            parent: None,
+            lowpass: None,
+            compressor: None,
+        }
     }
 }
 
@@ -538,6 +951,26 @@ pub struct AudioEngineSettings {
     /// This isn't a hard limitation, but apparently exceeding it results in
     /// worse performance.
     pub max_world_size: f32,
+
+    /// Max number of [`AudioReverbSphere`] applied at once. Only those which
+    /// affect the listener the most are used, others are ignored.
+    pub max_active_reverbs: usize,
+
+    /// Sounds with linear volume below this (after distance falloff and
+    /// occlusion) are not mixed, which saves CPU. Non-looped sounds which would
+    /// be that quiet when started are not played at all.
+    ///
+    /// _Increase this on low-end platforms._
+    pub virtual_volume: f32,
+
+    /// Changes of sound position (and velocity) smaller than this are ignored.
+    pub spatial_epsilon: f32,
+
+    /// Position of sounds which are further from the listener than their max
+    /// distance is updated only every this many frames. Such sounds are
+    /// attenuated the same regardless of distance, so it affects only panning
+    /// and doppler.
+    pub far_update_interval: u32,
 }
 
 impl Default for AudioEngineSettings {
@@ -547,6 +980,10 @@ impl Default for AudioEngineSettings {
             distance_scale: 1.,
             rolloff_scale: 1.,
             max_world_size: 500.,
+            max_active_reverbs: 8,
+            virtual_volume: 0.01,
+            spatial_epsilon: 0.001,
+            far_update_interval: 4,
         }
     }
 }
@@ -585,6 +1022,48 @@ pub struct AudioEngineInitSettings {
     ///
     /// Must be lower than `max_virtual_channels`.
     pub max_active_channels: usize,
+
+    /// If set, engine is updated by a separate thread at this rate (times per
+    /// second) instead of once per frame.
+    ///
+    /// Frame rate drops and hitches won't affect audio, but changes made by
+    /// systems are applied with delay of up to one update period.
+    pub update_thread_rate: Option<f32>,
+
+    /// How many sounds loaded as [`AudioLoadMode::CompressedSample`] can be
+    /// played at once, per file format. If not set, engine default (32) is
+    /// used.
+    ///
+    /// Each one is decoded during playback, so this limits CPU usage.
+    pub max_codecs: Option<usize>,
+
+    pub output_type: AudioOutputType,
+
+    /// File written by [`AudioOutputType::WavWriterNrt`]. If not set, it's
+    /// `fmodoutput.wav` in working directory.
+    pub output_file: Option<String>,
+
+    /// Samples per mixer block and number of blocks. If not set, engine
+    /// default (1024 samples, 4 blocks) is used.
+    ///
+    /// Output latency is `length * count / sample_rate`, i.e. 85 ms by default.
+    /// Lower values reduce latency, but increase CPU usage and may cause
+    /// stuttering. `(256, 2)` is about 10 ms.
+    pub dsp_buffer: Option<(u32, u32)>,
+
+    /// Mixer sample rate. If not set, engine default (48 kHz) is used.
+    pub sample_rate: Option<u32>,
+
+    pub speaker_mode: AudioSpeakerMode,
+
+    /// Allow FMOD Profiler to connect to the engine over network.
+    ///
+    /// Enabled by default only with `profile` feature.
+    pub enable_profiler: bool,
+
+    /// Where the engine allocates memory from. Applies only to the first
+    /// engine created by the process.
+    pub memory: AudioMemory,
 }
 
 impl Default for AudioEngineInitSettings {
@@ -592,6 +1071,117 @@ impl Default for AudioEngineInitSettings {
         Self {
             max_virtual_channels: 1024,
             max_active_channels: 32,
+            update_thread_rate: None,
+            max_codecs: None,
+            output_type: default(),
+            output_file: None,
+            dsp_buffer: None,
+            sample_rate: None,
+            speaker_mode: default(),
+            enable_profiler: cfg!(feature = "profile"),
+            memory: default(),
+        }
+    }
+}
+
+/// Memory used by the engine. Current usage is reported by
+/// [`AudioDiagnosticsPlugin`].
+#[derive(Clone, Copy, Default, PartialEq, Eq, Debug)]
+#[cfg_attr(feature = "serialize", derive(serde::Serialize, serde::Deserialize))]
+pub enum AudioMemory {
+    /// Allocated from system heap, as needed
+    #[default]
+    System,
+    /// Fixed pool of this many bytes, allocated once at startup.
+    ///
+    /// Engine fails to load and play sounds when it's exhausted, so it must
+    /// fit all loaded samples and stream buffers.
+    Pool(usize),
+    /// Allocated from system heap by a pool allocator, which reuses freed
+    /// blocks instead of returning them, and takes no more memory than the
+    /// limit (if specified).
+    ///
+    /// Small blocks are allocated in 256 KB chunks, so limit should be much
+    /// larger than that.
+    Allocator { limit: Option<usize> },
+}
+
+/// Audio output used by the engine
+#[derive(Clone, Copy, Default, PartialEq, Eq, Debug)]
+#[cfg_attr(feature = "serialize", derive(serde::Serialize, serde::Deserialize))]
+pub enum AudioOutputType {
+    /// Detected automatically
+    #[default]
+    Default,
+    /// No audio output, i.e. for dedicated servers
+    NoSound,
+    /// No audio output, and mixing isn't realtime: each frame engine mixes
+    /// exactly the frame's [`Time`] delta, however long it takes. For
+    /// deterministic tests and benchmarks.
+    ///
+    /// [`AudioEngineInitSettings::update_thread_rate`] is ignored.
+    NoSoundNrt,
+    /// Same as [`AudioOutputType::NoSoundNrt`], but output is written to WAV
+    /// file [`AudioEngineInitSettings::output_file`]. For rendering audio of
+    /// recorded gameplay or cinematics faster than realtime.
+    WavWriterNrt,
+    /// Windows
+    Wasapi,
+    /// Windows, low latency. Requires ASIO driver
+    Asio,
+    /// Linux
+    PulseAudio,
+    /// Linux, low latency
+    Alsa,
+    /// MacOS and iOS
+    CoreAudio,
+}
+
+impl From<AudioOutputType> for bridge::OutputType {
+    fn from(output: AudioOutputType) -> Self {
+        match output {
+            AudioOutputType::Default => Self::Default,
+            AudioOutputType::NoSound => Self::NoSound,
+            AudioOutputType::NoSoundNrt => Self::NoSoundNrt,
+            AudioOutputType::WavWriterNrt => Self::WavWriterNrt,
+            AudioOutputType::Wasapi => Self::Wasapi,
+            AudioOutputType::Asio => Self::Asio,
+            AudioOutputType::PulseAudio => Self::PulseAudio,
+            AudioOutputType::Alsa => Self::Alsa,
+            AudioOutputType::CoreAudio => Self::CoreAudio,
+        }
+    }
+}
+
+/// Speaker configuration the engine mixes to
+#[derive(Clone, Copy, Default, PartialEq, Eq, Debug)]
+#[cfg_attr(feature = "serialize", derive(serde::Serialize, serde::Deserialize))]
+pub enum AudioSpeakerMode {
+    /// Same as output device
+    #[default]
+    Default,
+    Mono,
+    Stereo,
+    /// 4.0
+    Quad,
+    /// 5.0
+    Surround,
+    /// 5.1
+    Surround51,
+    /// 7.1
+    Surround71,
+}
+
+impl From<AudioSpeakerMode> for bridge::SpeakerMode {
+    fn from(mode: AudioSpeakerMode) -> Self {
+        match mode {
+            AudioSpeakerMode::Default => Self::Default,
+            AudioSpeakerMode::Mono => Self::Mono,
+            AudioSpeakerMode::Stereo => Self::Stereo,
+            AudioSpeakerMode::Quad => Self::Quad,
+            AudioSpeakerMode::Surround => Self::Surround,
+            AudioSpeakerMode::Surround51 => Self::Surround51,
+            AudioSpeakerMode::Surround71 => Self::Surround71,
         }
     }
 }
@@ -606,7 +1196,12 @@ impl Plugin for FmodAudioPlugin {
     fn build(&self, app: &mut App) {
         // TODO(later): allow re-init of everything
 
-        *BRIDGE.lock().unwrap() = {
+        let is_nrt = matches!(
+            self.settings.output_type,
+            AudioOutputType::NoSoundNrt | AudioOutputType::WavWriterNrt
+        );
+
+        *BRIDGE.write().unwrap() = {
             let p = bridge::create(bridge::InitParams {
                 max_virtual_channels: self.settings.max_virtual_channels.min(4095) as i32,
                 max_active_channels: self
@@ -614,6 +1209,34 @@ impl Plugin for FmodAudioPlugin {
                     .max_active_channels
                     .min(self.settings.max_virtual_channels)
                     as i32,
+                output_type: self.settings.output_type.into(),
+                update_thread_rate: self
+                    .settings
+                    .update_thread_rate
+                    .filter(|_| !is_nrt)
+                    .unwrap_or_default(),
+                max_codecs: self
+                    .settings
+                    .max_codecs
+                    .unwrap_or_default()
+                    .min(i32::MAX as usize) as i32,
+                dsp_buffer_length: self.settings.dsp_buffer.map(|v| v.0).unwrap_or_default(),
+                dsp_buffer_count: self.settings.dsp_buffer.map(|v| v.1).unwrap_or_default() as i32,
+                sample_rate: self.settings.sample_rate.unwrap_or_default() as i32,
+                speaker_mode: self.settings.speaker_mode.into(),
+                enable_profiler: self.settings.enable_profiler,
+                memory_mode: match self.settings.memory {
+                    AudioMemory::System => bridge::MemoryMode::System,
+                    AudioMemory::Pool(_) => bridge::MemoryMode::Pool,
+                    AudioMemory::Allocator { .. } => bridge::MemoryMode::Allocator,
+                },
+                memory_size: match self.settings.memory {
+                    AudioMemory::System => 0,
+                    AudioMemory::Pool(size) => size,
+                    AudioMemory::Allocator { limit } => limit.unwrap_or_default(),
+                }
+                .min(i32::MAX as usize) as u32,
+                output_file: self.settings.output_file.clone().unwrap_or_default(),
             });
             // TODO(later): allow bridge to be None
             if p.is_null() {
@@ -622,17 +1245,41 @@ impl Plugin for FmodAudioPlugin {
             Some(p)
         };
 
+        let clock: AudioClock = {
+            let mut bridge = BRIDGE.write().unwrap();
+            bridge
+                .as_mut()
+                .unwrap()
+                .pin_mut()
+                .begin_frame_clock()
+                .into()
+        };
+
+        if let Some(server) = app.world.get_resource::<AssetServer>() {
+            crate::asset_stream::register(server.clone());
+        }
+
+        if is_nrt {
+            app.insert_resource(NonRealtimeOutput);
+        }
+
         app.configure_sets(PostUpdate, AudioSystem)
             .init_resource::<AudioSettings>()
+            .insert_resource(clock)
             .init_asset::<AudioSource>()
-            .register_asset_loader(AudioFileLoader);
+            .init_asset::<AudioGeometryPrototype>()
+            .register_asset_loader(AudioFileLoader)
+            .register_asset_loader(AudioGeometryLoader);
 
         // system update
         app.add_systems(
             PostUpdate,
             (
-                update_listener.after(TransformSystem::TransformPropagate),
+                update_listener
+                    .after(TransformSystem::TransformPropagate)
+                    .before(play_audio), // voice budget uses listener position
                 update_system.after(update_listener),
+                update_clock.after(update_system),
                 update_engine_settings
                     .before(update_system)
                     .run_if(resource_changed::<AudioSettings>),
@@ -644,6 +1291,7 @@ impl Plugin for FmodAudioPlugin {
         app.init_resource::<AudioInstanceMapping>().add_systems(
             PostUpdate,
             (
+                update_sound_templates.before(play_audio),
                 play_audio
                     .before(update_engine_settings)
                     .after(TransformSystem::TransformPropagate),
@@ -661,7 +1309,16 @@ impl Plugin for FmodAudioPlugin {
             PostUpdate,
             (
                 add_geometry.after(TransformSystem::TransformPropagate),
+                add_geometry_instances.after(TransformSystem::TransformPropagate),
+                update_geometry_transform
+                    .after(add_geometry)
+                    .after(add_geometry_instances),
+                update_geometry_lod
+                    .after(add_geometry)
+                    .after(add_geometry_instances),
                 remove_geometry,
+                remove_geometry_instances,
+                remove_geometry_lod,
             )
                 .in_set(AudioSystem),
         );
@@ -678,14 +1335,130 @@ impl Plugin for FmodAudioPlugin {
     }
 }
 
+/// Adds engine statistics to [`DiagnosticsStore`](bevy::diagnostic::DiagnosticsStore).
+///
+/// Besides constants in this type, for each timed bridge method there are
+/// `audio/bridge/{method}/calls` (calls per frame) and
+/// `audio/bridge/{method}/time` (milliseconds per frame) diagnostics.
+///
+/// Must be added after [`FmodAudioPlugin`].
+#[derive(Default)]
+pub struct AudioDiagnosticsPlugin;
+
+impl AudioDiagnosticsPlugin {
+    /// CPU usage of mixer thread, percent
+    pub const CPU_DSP: DiagnosticPath = DiagnosticPath::const_new("audio/cpu/dsp");
+    /// CPU usage of streaming thread, percent
+    pub const CPU_STREAM: DiagnosticPath = DiagnosticPath::const_new("audio/cpu/stream");
+    /// CPU usage of geometry thread, percent
+    pub const CPU_GEOMETRY: DiagnosticPath = DiagnosticPath::const_new("audio/cpu/geometry");
+    /// CPU usage of engine update, percent
+    pub const CPU_UPDATE: DiagnosticPath = DiagnosticPath::const_new("audio/cpu/update");
+    /// Number of playing channels, including virtual ones
+    pub const CHANNELS_PLAYING: DiagnosticPath =
+        DiagnosticPath::const_new("audio/channels/playing");
+    /// Number of playing channels which are actually mixed
+    pub const CHANNELS_REAL: DiagnosticPath = DiagnosticPath::const_new("audio/channels/real");
+    /// Memory currently allocated by the engine, bytes
+    pub const MEMORY: DiagnosticPath = DiagnosticPath::const_new("audio/memory");
+    /// Bytes read from sample data per frame
+    pub const SAMPLE_BYTES_READ: DiagnosticPath =
+        DiagnosticPath::const_new("audio/file/sample_read");
+    /// Bytes read by streams per frame
+    pub const STREAM_BYTES_READ: DiagnosticPath =
+        DiagnosticPath::const_new("audio/file/stream_read");
+    /// Bytes read for other purposes per frame
+    pub const OTHER_BYTES_READ: DiagnosticPath = DiagnosticPath::const_new("audio/file/other_read");
+}
+
+impl Plugin for AudioDiagnosticsPlugin {
+    fn build(&self, app: &mut App) {
+        for (path, suffix) in [
+            (Self::CPU_DSP, "%"),
+            (Self::CPU_STREAM, "%"),
+            (Self::CPU_GEOMETRY, "%"),
+            (Self::CPU_UPDATE, "%"),
+            (Self::CHANNELS_PLAYING, ""),
+            (Self::CHANNELS_REAL, ""),
+            (Self::MEMORY, " B"),
+            (Self::SAMPLE_BYTES_READ, " B"),
+            (Self::STREAM_BYTES_READ, " B"),
+            (Self::OTHER_BYTES_READ, " B"),
+        ] {
+            app.register_diagnostic(Diagnostic::new(path).with_suffix(suffix));
+        }
+
+        // set of timed methods is fixed, so it's enough to get it once
+        let stats = BRIDGE
+            .write()
+            .unwrap()
+            .as_mut()
+            .unwrap()
+            .pin_mut()
+            .get_stats();
+        let methods: Vec<_> = stats
+            .methods
+            .iter()
+            .map(|method| {
+                let calls = DiagnosticPath::new(format!("audio/bridge/{}/calls", method.name));
+                let time = DiagnosticPath::new(format!("audio/bridge/{}/time", method.name));
+                app.register_diagnostic(Diagnostic::new(calls.clone()))
+                    .register_diagnostic(Diagnostic::new(time.clone()).with_suffix(" ms"));
+                (calls, time)
+            })
+            .collect();
+
+        app.insert_resource(AudioDiagnosticsPaths { methods })
+            .add_systems(PostUpdate, update_diagnostics.after(AudioSystem));
+    }
+}
+
 lazy_static::lazy_static! {
-    /// Engine instance (C++ wrapper)
-    static ref BRIDGE: Mutex<Option<cxx::UniquePtr<bridge::Bridge>>> = default();
+    /// Engine instance (C++ wrapper).
+    ///
+    /// Most methods require write lock. Only per-frame updates (channel
+    /// positions and parameters, listeners) are queued: `queue_*` methods need
+    /// only read lock, so systems using them can run in parallel.
+    ///
+    /// Systems which create or destroy engine objects (playing and stopping
+    /// sounds, sound templates, geometry, reverbs) take the write lock and still
+    /// exclude each other.
+    static ref BRIDGE: RwLock<Option<cxx::UniquePtr<bridge::Bridge>>> = default();
 }
 
 /// IDs used for sounds, channels and spatial objects
 type EngineId = i32;
 
+/// Incremented each time engine finishes a non-blocking load
+static LOAD_EVENTS: AtomicU64 = AtomicU64::new(0);
+/// Tasks waiting for the next load event
+static LOAD_WAKERS: Mutex<Vec<Waker>> = Mutex::new(Vec::new());
+
+/// Called by the engine from its thread, see `bridge_sound_loaded`
+pub(crate) fn notify_sound_loaded() {
+    LOAD_EVENTS.fetch_add(1, Ordering::Release);
+    for waker in LOAD_WAKERS.lock().unwrap().drain(..) {
+        waker.wake();
+    }
+}
+
+/// Completes after any load event which happened after `seen` was read
+fn wait_for_load_event(seen: u64) -> impl std::future::Future<Output = ()> {
+    std::future::poll_fn(move |cx| {
+        if LOAD_EVENTS.load(Ordering::Acquire) != seen {
+            return Poll::Ready(());
+        }
+        LOAD_WAKERS.lock().unwrap().push(cx.waker().clone());
+
+        // event could've happened before the waker was added
+        if LOAD_EVENTS.load(Ordering::Acquire) != seen {
+            Poll::Ready(())
+        } else {
+            Poll::Pending
+        }
+    })
+}
+
 //
 // assets
 
@@ -693,6 +1466,63 @@ struct AudioFileLoader;
 
 impl bevy::asset::AssetLoader for AudioFileLoader {
     type Asset = AudioSource;
+    type Settings = AudioLoaderSettings;
+    type Error = String;
+
+    fn load<'a>(
+        &'a self,
+        reader: &'a mut bevy::asset::io::Reader,
+        settings: &'a Self::Settings,
+        load_context: &'a mut bevy::asset::LoadContext,
+    ) -> bevy::utils::BoxedFuture<'a, Result<Self::Asset, Self::Error>> {
+        Box::pin(async move {
+            let source = if settings.mode == AudioLoadMode::Stream && settings.stream_from_source {
+                // reader can't be passed to the engine, but it's used to find
+                // file size, so the engine doesn't read whole file to do it
+                let path = load_context.asset_path().clone_owned();
+                let file = crate::asset_stream::scan(path.to_string(), reader)
+                    .await
+                    .map_err(|e| format!("failed to load file: {e}"))?;
+                AudioSource::stream_asset(path, settings.stream_buffer_size).map(|mut source| {
+                    source.stream_file = Some(file);
+                    source
+                })
+            } else {
+                let mut bytes = vec![];
+                reader
+                    .read_to_end(&mut bytes)
+                    .await
+                    .map_err(|e| format!("failed to load file: {e}"))?;
+                AudioSource::from_memory_with(bytes, settings)
+            };
+            let source = source.ok_or_else(|| "failed to parse file".to_string())?;
+
+            // engine loads file in background and notifies when it's done
+            match source.wait_until_loaded().await {
+                AudioLoadState::Ready => {
+                    // frees buffer used only for loading
+                    let mut bridge = BRIDGE.write().unwrap();
+                    bridge
+                        .as_mut()
+                        .unwrap()
+                        .pin_mut()
+                        .poll_load_state(source.id);
+                    Ok(source)
+                }
+                _ => Err("failed to decode file".to_string()),
+            }
+        })
+    }
+
+    fn extensions(&self) -> &[&str] {
+        AUDIO_FILE_EXTENSIONS
+    }
+}
+
+struct AudioGeometryLoader;
+
+impl bevy::asset::AssetLoader for AudioGeometryLoader {
+    type Asset = AudioGeometryPrototype;
     type Settings = ();
     type Error = String;
 
@@ -708,12 +1538,13 @@ impl bevy::asset::AssetLoader for AudioFileLoader {
                 .read_to_end(&mut bytes)
                 .await
                 .map_err(|e| format!("failed to load file: {e}"))?;
-            AudioSource::from_memory(&bytes).ok_or_else(|| "failed to parse file".to_string())
+            AudioGeometryPrototype::from_baked(&bytes)
+                .ok_or_else(|| "failed to parse file".to_string())
         })
     }
 
     fn extensions(&self) -> &[&str] {
-        AUDIO_FILE_EXTENSIONS
+        &["fmodgeom"]
     }
 }
 
@@ -721,62 +1552,108 @@ impl bevy::asset::AssetLoader for AudioFileLoader {
 // system update
 
 struct ListenerData {
-    data: bridge::ListenerParams,
-    old_position: Option<Vec3>,
+    listeners: Vec<bridge::ListenerParams>,
+    old_positions: HashMap<Entity, Vec3>,
+    /// Sorted, so each listener keeps its index while others are added or removed
+    entities: Vec<(Entity, GlobalTransform)>,
 }
 
 impl Default for ListenerData {
     fn default() -> Self {
         Self {
-            data: bridge::ListenerParams {
+            listeners: vec![bridge::ListenerParams {
                 forward: Vec3::NEG_Z.into(),
                 up: Vec3::Y.into(),
                 ..default()
-            },
-            old_position: None,
+            }],
+            old_positions: default(),
+            entities: default(),
         }
     }
 }
 
 fn update_listener(
-    listener_entity: Query<&GlobalTransform, With<AudioListener>>,
-    mut listener: Local<ListenerData>,
+    listener_entities: Query<(Entity, &GlobalTransform), With<AudioListener>>,
+    mut data: Local<ListenerData>,
     time: Res<Time>,
 ) {
-    if let Ok(transform) = listener_entity.get_single() {
-        let position = transform.translation();
-        let velocity = if time.delta() != default() {
-            (position - listener.old_position.unwrap_or(position)) / time.delta_seconds()
-        } else {
-            Vec3::ZERO
-        };
-        listener.old_position = position.into();
+    let data = &mut *data;
+
+    data.entities.clear();
+    data.entities
+        .extend(listener_entities.iter().map(|(e, t)| (e, *t)));
 
-        let listener = &mut listener.data;
-        listener.position = position.into();
-        listener.velocity = velocity.into();
-        listener.forward = transform.forward().into();
-        listener.up = transform.up().into();
+    if data.entities.is_empty() {
+        for listener in &mut data.listeners {
+            listener.velocity = default();
+        }
+        data.old_positions.clear();
     } else {
-        listener.data.velocity = default();
-        listener.old_position = None;
+        data.entities.sort_unstable_by_key(|(entity, _)| *entity);
+        data.entities.truncate(MAX_AUDIO_LISTENERS);
+
+        data.listeners.clear();
+        for (entity, transform) in &data.entities {
+            let position = transform.translation();
+            let old_position = data
+                .old_positions
+                .insert(*entity, position)
+                .unwrap_or(position);
+            let velocity = if time.delta() != default() {
+                (position - old_position) / time.delta_seconds()
+            } else {
+                Vec3::ZERO
+            };
+
+            data.listeners.push(bridge::ListenerParams {
+                position: position.into(),
+                velocity: velocity.into(),
+                forward: transform.forward().into(),
+                up: transform.up().into(),
+            });
+        }
+
+        let entities = &data.entities;
+        data.old_positions
+            .retain(|entity, _| entities.iter().any(|(e, _)| e == entity));
     }
 
+    // applied in `update_system`, or in play_audio if it's earlier
     BRIDGE
-        .lock()
+        .read()
         .unwrap()
-        .as_mut()
+        .as_ref()
         .unwrap()
-        .pin_mut()
-        .update_listener(listener.data.clone());
+        .queue_listener_updates(&data.listeners);
+}
+
+/// Present if engine mixes only when it's updated
+#[derive(Resource)]
+struct NonRealtimeOutput;
+
+fn update_system(nrt: Option<Res<NonRealtimeOutput>>, clock: Res<AudioClock>, time: Res<Time>) {
+    let mut bridge = BRIDGE.write().unwrap();
+    let bridge = bridge.as_mut().unwrap();
+
+    if nrt.is_some() {
+        // Mix up to the current game time. Mixer advances by whole blocks, so
+        // it's compared with total time to not accumulate rounding errors
+        let target = (time.elapsed_seconds_f64() * clock.sample_rate as f64) as u64;
+        let samples = target.saturating_sub(clock.clock).min(u32::MAX as u64);
+        bridge.pin_mut().render(samples as u32);
+    } else {
+        bridge.pin_mut().update();
+    }
 }
 
-fn update_system() {
-    BRIDGE.lock().unwrap().as_mut().unwrap().pin_mut().update();
+fn update_clock(mut clock: ResMut<AudioClock>) {
+    let mut bridge = BRIDGE.write().unwrap();
+    let bridge = bridge.as_mut().unwrap();
+    *clock = bridge.pin_mut().begin_frame_clock().into();
 }
 
 fn update_engine_settings(settings: Res<AudioSettings>) {
-    let mut bridge = BRIDGE.lock().unwrap();
+    let mut bridge = BRIDGE.write().unwrap();
     let bridge = bridge.as_mut().unwrap();
 
     let master_volume = settings
@@ -785,9 +1662,29 @@ fn update_engine_settings(settings: Res<AudioSettings>) {
         .unwrap_or(0.);
 
     for (id, params) in settings.groups.iter() {
+        let compressor = params.compressor.as_ref();
         bridge.pin_mut().update_group(bridge::GroupParams {
             user_id: id.0,
-            volume: params.volume * master_volume,
+            volume: params.volume,
+            max_instances: params
+                .max_instances
+                .map(|v| v.clamp(1, u32::MAX as usize) as u32)
+                .unwrap_or(0),
+            virtual_volume: params.virtual_volume,
+            parent_id: params.parent.map(|v| v.0).unwrap_or(-1),
+            lowpass_cutoff: params.lowpass.unwrap_or_default(),
+            compressor_ratio: compressor.map(|c| c.ratio).unwrap_or(1.),
+            compressor_threshold: compressor.map(|c| c.threshold).unwrap_or_default(),
+            compressor_attack: compressor
+                .map(|c| c.attack.as_secs_f32() * 1000.)
+                .unwrap_or_default(),
+            compressor_release: compressor
+                .map(|c| c.release.as_secs_f32() * 1000.)
+                .unwrap_or_default(),
+            sidechain_group_id: compressor
+                .and_then(|c| c.sidechain)
+                .map(|v| v.0)
+                .unwrap_or(-1),
         })
     }
 
@@ -797,6 +1694,11 @@ fn update_engine_settings(settings: Res<AudioSettings>) {
         distance_scale: engine.distance_scale,
         rolloff_scale: engine.rolloff_scale,
         max_world_size: engine.max_world_size,
+        max_active_reverbs: engine.max_active_reverbs.min(u32::MAX as usize) as u32,
+        virtual_volume: engine.virtual_volume,
+        spatial_epsilon: engine.spatial_epsilon,
+        far_update_interval: engine.far_update_interval,
+        master_volume,
     });
 }
 
@@ -806,6 +1708,7 @@ fn update_engine_settings(settings: Res<AudioSettings>) {
 #[derive(Resource, Default)]
 struct AudioInstanceMapping {
     ids: HashMap<Entity, EngineId>,
+    entities: HashMap<EngineId, Entity>,
     just_removed: HashSet<Entity>,
 }
 
@@ -821,6 +1724,14 @@ struct AudioInstance {
     _source: Handle<AudioSource>,
 }
 
+/// Sound which is being started by `play_audio`
+struct NewAudio {
+    entity: Entity,
+    source: Handle<AudioSource>,
+    position: Vec3,
+    looped: bool,
+}
+
 fn play_audio(
     new_audio: Query<
         (
@@ -830,6 +1741,7 @@ fn play_audio(
             Option<&AudioLoop>,
             Option<&AudioParameters>,
             Option<&AudioStartupDelay>,
+            Option<&AudioStartTime>,
             Option<&AudioGroup>,
         ),
         Added<Handle<AudioSource>>,
@@ -837,15 +1749,12 @@ fn play_audio(
     sounds: Res<Assets<AudioSource>>,
     mut commands: Commands,
     mut mapping: ResMut<AudioInstanceMapping>,
+    mut started: Local<Vec<NewAudio>>,
+    mut params: Local<Vec<bridge::ChannelParams>>,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
-    let bridge = bridge.as_mut().unwrap();
-
-    for (entity, source, transform, looped, parameters, startup_delay, group) in new_audio.iter() {
-        let Some(mut commands) = commands.get_entity(entity) else {
-            continue;
-        };
-
+    for (entity, source, transform, looped, parameters, startup_delay, start_time, group) in
+        new_audio.iter()
+    {
         let looped = looped.is_some();
 
         let sound = match sounds.get(source) {
@@ -853,7 +1762,9 @@ fn play_audio(
             None => {
                 warn!("AudioSource asset {source:?} not loaded yet! Sound won't be played");
                 if !looped {
-                    commands.despawn_recursive();
+                    if let Some(commands) = commands.get_entity(entity) {
+                        commands.despawn_recursive();
+                    }
                 }
                 continue;
             }
@@ -862,7 +1773,7 @@ fn play_audio(
         let parameters = parameters.copied().unwrap_or_else(|| sound.params());
         let position = transform.map(|t| t.translation()).unwrap_or(Vec3::ZERO);
 
-        let instance = bridge.pin_mut().play_channel(bridge::ChannelParams {
+        params.push(bridge::ChannelParams {
             file_id: sound.id,
             group_id: group.copied().unwrap_or_default().0,
             priority: parameters.priority as i32,
@@ -875,10 +1786,36 @@ fn play_audio(
             volume: parameters.volume,
             pitch: parameters.speed,
             startup_delay: startup_delay.map(|v| v.0).unwrap_or_default().as_micros() as i32,
+            start_clock: start_time.copied().unwrap_or_default().0,
+            cooldown: sound.cooldown.as_micros().min(i32::MAX as u128) as i32,
+        });
+        started.push(NewAudio {
+            entity,
+            source: source.clone(),
+            position,
+            looped,
         });
+    }
 
-        if instance == -1 {
-            if !looped {
+    if params.is_empty() {
+        return;
+    }
+
+    let instances = {
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap();
+        bridge.pin_mut().play_channels_batch(&params)
+    };
+    params.clear();
+
+    for (audio, instance) in started.drain(..).zip(instances) {
+        let Some(mut commands) = commands.get_entity(audio.entity) else {
+            continue;
+        };
+
+        // error or sound was rejected by voice budget (i.e. it wouldn't be audible)
+        if instance < 0 {
+            if !audio.looped {
                 commands.despawn_recursive();
             }
             continue;
@@ -886,10 +1823,11 @@ fn play_audio(
 
         commands.insert(AudioInstance {
             id: instance,
-            old_position: position,
-            _source: source.clone(),
+            old_position: audio.position,
+            _source: audio.source,
         });
-        mapping.ids.insert(entity, instance);
+        mapping.ids.insert(audio.entity, instance);
+        mapping.entities.insert(instance, audio.entity);
     }
 }
 
@@ -899,13 +1837,14 @@ fn stop_audio(
     mut mapping: ResMut<AudioInstanceMapping>,
     mut commands: Commands,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
+    let mut bridge = BRIDGE.write().unwrap();
     let bridge = bridge.as_mut().unwrap();
 
     for entity in removed.read() {
         let just_removed = mapping.just_removed.remove(&entity);
         match mapping.ids.remove(&entity) {
             Some(instance) => {
+                mapping.entities.remove(&instance);
                 if let Some(mut commands) = commands.get_entity(entity) {
                     commands.remove::<AudioInstance>();
                 }
@@ -920,31 +1859,74 @@ fn stop_audio(
     }
 }
 
+// Hints from sources become engine defaults for their channels; play_audio
+// then sets only parameters which differ. Templates of sounds which are still
+// loading are applied by the engine once loading is finished.
+fn update_sound_templates(
+    mut events: EventReader<AssetEvent<AudioSource>>,
+    sounds: Res<Assets<AudioSource>>,
+) {
+    let mut bridge = None;
+
+    for event in events.read() {
+        let (AssetEvent::Added { id } | AssetEvent::Modified { id }) = event else {
+            continue;
+        };
+        let Some(sound) = sounds.get(*id) else {
+            continue;
+        };
+
+        let params = &sound.params;
+        let template = bridge::SoundTemplate {
+            is_positional: sound.is_positional,
+            min_distance: params.min_distance,
+            max_distance: params.max_distance,
+            looped: sound.looped,
+            priority: params.priority as i32,
+        };
+
+        let bridge = bridge.get_or_insert_with(|| BRIDGE.write().unwrap());
+        let bridge = bridge.as_mut().unwrap().pin_mut();
+
+        let template_id = sound.template_id.load(Ordering::Relaxed);
+        if template_id == -1 {
+            let template_id = bridge.add_sound_template(sound.id, template);
+            sound.template_id.store(template_id, Ordering::Relaxed);
+        } else {
+            bridge.set_sound_template(template_id, template);
+        }
+    }
+}
+
 // sound stopped, despawn the entity
 fn detect_stopped_audio(mut mapping: ResMut<AudioInstanceMapping>, mut commands: Commands) {
-    let mut bridge = BRIDGE.lock().unwrap();
-    let bridge = bridge.as_mut().unwrap();
+    let finished = BRIDGE
+        .write()
+        .unwrap()
+        .as_mut()
+        .unwrap()
+        .pin_mut()
+        .collect_finished_channels();
 
-    let mapping = &mut *mapping;
-    mapping.ids.retain(|entity, instance| {
-        let keep = bridge.pin_mut().is_playing_channel(*instance);
-        if !keep {
-            if let Some(commands) = commands.get_entity(*entity) {
-                commands.despawn_recursive();
-            }
-            bridge.pin_mut().free_channel(*instance);
-            mapping.just_removed.insert(*entity);
+    for instance in finished {
+        let Some(entity) = mapping.entities.remove(&instance) else {
+            continue;
+        };
+        mapping.ids.remove(&entity);
+        mapping.just_removed.insert(entity);
+
+        if let Some(commands) = commands.get_entity(entity) {
+            commands.despawn_recursive();
         }
-        keep
-    });
+    }
 }
 
 fn update_spatial_audio(
     mut sounds: Query<(&GlobalTransform, &mut AudioInstance)>,
     time: Res<Time>,
+    mut entries: Local<Vec<bridge::ChannelBatchEntry>>,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
-    let bridge = bridge.as_mut().unwrap();
+    entries.clear();
 
     for (transform, mut instance) in sounds.iter_mut() {
         let position = transform.translation();
@@ -955,35 +1937,62 @@ fn update_spatial_audio(
         };
         instance.old_position = position.into();
 
-        bridge.pin_mut().update_channel(
-            instance.id,
-            bridge::ChannelUpdateParams {
+        entries.push(bridge::ChannelBatchEntry {
+            id: instance.id,
+            params: bridge::ChannelUpdateParams {
                 set_position: true,
                 position: position.into(),
                 velocity: velocity.into(),
                 ..default()
             },
-        );
+        });
     }
+
+    queue_channel_updates(&entries);
 }
 
 fn update_audio_parameters(
     sounds: Query<(&AudioParameters, &AudioInstance), Changed<AudioParameters>>,
+    mut entries: Local<Vec<bridge::ChannelBatchEntry>>,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
-    let bridge = bridge.as_mut().unwrap();
+    entries.clear();
 
     for (parameters, instance) in sounds.iter() {
-        bridge.pin_mut().update_channel(
-            instance.id,
-            bridge::ChannelUpdateParams {
+        entries.push(bridge::ChannelBatchEntry {
+            id: instance.id,
+            params: bridge::ChannelUpdateParams {
                 set_volume_etc: true,
                 volume: parameters.volume,
                 pitch: parameters.speed,
                 priority: parameters.priority as i32,
                 ..default()
             },
-        );
+        });
+    }
+
+    queue_channel_updates(&entries);
+}
+
+/// Doesn't block other systems using the bridge; updates are applied in
+/// `update_system`
+fn queue_channel_updates(entries: &[bridge::ChannelBatchEntry]) {
+    if entries.is_empty() {
+        return;
+    }
+
+    let queued = BRIDGE
+        .read()
+        .unwrap()
+        .as_ref()
+        .unwrap()
+        .queue_channel_updates(entries);
+
+    if queued < entries.len() {
+        // queue is full, apply the rest immediately. This applies the queue
+        // first, so older positions from it won't overwrite the new ones.
+        let mut bridge = BRIDGE.write().unwrap();
+        let bridge = bridge.as_mut().unwrap();
+        bridge.pin_mut().update_channels_batch(&entries[queued..]);
     }
 }
 
@@ -991,53 +2000,205 @@ fn update_audio_parameters(
 // geometry
 
 #[derive(Resource, Default)]
-struct GeometryInstanceMapping(HashMap<Entity, EngineId>);
+struct GeometryInstanceMapping {
+    geometries: HashMap<Entity, EngineId>,
+    instances: HashMap<Entity, EngineId>,
+}
+
+/// Engine object of either [`AudioGeometry`] or
+/// [`Handle<AudioGeometryPrototype>`]
+#[derive(Component)]
+struct AudioGeometryInstance {
+    id: EngineId,
+}
+
+impl AudioGeometry {
+    /// Calls `f` with all polygons in a single buffer
+    fn with_flat<R>(&self, f: impl FnOnce(bridge::FlatGeometry) -> R) -> R {
+        let vertices: Vec<bridge::Vector> = self
+            .polygon_vertices
+            .iter()
+            .flatten()
+            .map(|vertex| (*vertex).into())
+            .collect();
+        let polygon_sizes: Vec<u32> = self
+            .polygon_vertices
+            .iter()
+            .map(|polygon| polygon.len() as u32)
+            .collect();
+
+        f(bridge::FlatGeometry {
+            direct_occlusion: self.params.direct_occlusion.clamp(0., 1.),
+            reverb_occlusion: self.params.reverb_occlusion.clamp(0., 1.),
+            vertices: &vertices,
+            polygon_sizes: &polygon_sizes,
+        })
+    }
+}
 
 fn add_geometry(
     new_geometries: Query<(Entity, &AudioGeometry, &GlobalTransform), Added<AudioGeometry>>,
     mut mapping: ResMut<GeometryInstanceMapping>,
+    mut commands: Commands,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
+    let mut bridge = BRIDGE.write().unwrap();
     let bridge = bridge.as_mut().unwrap();
 
     for (entity, geometry, transform) in new_geometries.iter() {
-        let instance = bridge.pin_mut().add_geometry(bridge::Geometry {
-            direct_occlusion: geometry.params.direct_occlusion.clamp(0., 1.),
-            reverb_occlusion: geometry.params.reverb_occlusion.clamp(0., 1.),
-            polygons: geometry
-                .polygon_vertices
-                .iter()
-                .map(|polygon| bridge::Polygon {
-                    vertices: polygon
-                        .iter()
-                        .map(|vertex| (*transform * *vertex).into())
-                        .collect(),
-                })
-                .collect(),
-        });
+        let instance = geometry.with_flat(|geometry| bridge.pin_mut().add_geometry_flat(geometry));
         if instance == -1 {
             error!("failed to create geometry object for {entity:?}");
             continue;
         }
-        mapping.0.insert(entity, instance);
+        bridge
+            .pin_mut()
+            .update_geometry_transform(instance, transform.into());
+
+        mapping.geometries.insert(entity, instance);
+        commands
+            .entity(entity)
+            .insert(AudioGeometryInstance { id: instance });
+    }
+}
+
+fn add_geometry_instances(
+    new_instances: Query<
+        (Entity, &Handle<AudioGeometryPrototype>, &GlobalTransform),
+        Without<AudioGeometryInstance>,
+    >,
+    prototypes: Res<Assets<AudioGeometryPrototype>>,
+    mut mapping: ResMut<GeometryInstanceMapping>,
+    mut commands: Commands,
+) {
+    let mut bridge = BRIDGE.write().unwrap();
+    let bridge = bridge.as_mut().unwrap();
+
+    for (entity, prototype, transform) in new_instances.iter() {
+        // instance is created once asset is loaded
+        let Some(prototype) = prototypes.get(prototype) else {
+            continue;
+        };
+
+        let instance = bridge
+            .pin_mut()
+            .add_geometry_instance(prototype.id, transform.into());
+        if instance == -1 {
+            error!("failed to create geometry instance for {entity:?}");
+            commands
+                .entity(entity)
+                .remove::<Handle<AudioGeometryPrototype>>();
+            continue;
+        }
+
+        mapping.instances.insert(entity, instance);
+        commands
+            .entity(entity)
+            .insert(AudioGeometryInstance { id: instance });
+    }
+}
+
+fn update_geometry_transform(
+    geometries: Query<(&AudioGeometryInstance, &GlobalTransform), Changed<GlobalTransform>>,
+) {
+    let mut bridge = BRIDGE.write().unwrap();
+    let bridge = bridge.as_mut().unwrap();
+
+    for (geometry, transform) in geometries.iter() {
+        bridge
+            .pin_mut()
+            .update_geometry_transform(geometry.id, transform.into());
+    }
+}
+
+fn update_geometry_lod(
+    geometries: Query<
+        (Entity, &AudioGeometryInstance, &AudioGeometryLod),
+        Or<(Changed<AudioGeometryLod>, Added<AudioGeometryInstance>)>,
+    >,
+    prototypes: Res<Assets<AudioGeometryPrototype>>,
+) {
+    let mut bridge = BRIDGE.write().unwrap();
+    let bridge = bridge.as_mut().unwrap();
+
+    for (entity, geometry, lod) in geometries.iter() {
+        let proxy = lod.proxy.as_ref().map(|proxy| prototypes.get(proxy));
+        if let Some(None) = proxy {
+            error!("geometry proxy for {entity:?} is not loaded");
+        }
+
+        bridge.pin_mut().set_geometry_lod(
+            geometry.id,
+            bridge::GeometryLod {
+                proxy_prototype_id: proxy.flatten().map(|proxy| proxy.id).unwrap_or(-1),
+                proxy_distance: lod.proxy_distance,
+                cull_distance: lod.cull_distance,
+            },
+        );
+    }
+}
+
+fn remove_geometry_lod(
+    mut removed: RemovedComponents<AudioGeometryLod>,
+    geometries: Query<&AudioGeometryInstance>,
+) {
+    let mut bridge = BRIDGE.write().unwrap();
+    let bridge = bridge.as_mut().unwrap();
+
+    for entity in removed.read() {
+        // geometry may be already removed too
+        if let Ok(geometry) = geometries.get(entity) {
+            bridge.pin_mut().set_geometry_lod(
+                geometry.id,
+                bridge::GeometryLod {
+                    proxy_prototype_id: -1,
+                    proxy_distance: 0.,
+                    cull_distance: 0.,
+                },
+            );
+        }
     }
 }
 
 fn remove_geometry(
     mut removed: RemovedComponents<AudioGeometry>,
     mut mapping: ResMut<GeometryInstanceMapping>,
+    mut commands: Commands,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
+    let mut bridge = BRIDGE.write().unwrap();
     let bridge = bridge.as_mut().unwrap();
 
     for entity in removed.read() {
-        match mapping.0.remove(&entity) {
-            Some(id) => bridge.pin_mut().free_geometry(id),
+        match mapping.geometries.remove(&entity) {
+            Some(id) => {
+                bridge.pin_mut().free_geometry(id);
+                if let Some(mut entity) = commands.get_entity(entity) {
+                    entity.remove::<AudioGeometryInstance>();
+                }
+            }
             None => error!("removing non-existent geometry for entity {entity:?}"),
         }
     }
 }
 
+fn remove_geometry_instances(
+    mut removed: RemovedComponents<Handle<AudioGeometryPrototype>>,
+    mut mapping: ResMut<GeometryInstanceMapping>,
+    mut commands: Commands,
+) {
+    let mut bridge = BRIDGE.write().unwrap();
+    let bridge = bridge.as_mut().unwrap();
+
+    for entity in removed.read() {
+        // instance doesn't exist if prototype wasn't loaded or on error
+        if let Some(id) = mapping.instances.remove(&entity) {
+            bridge.pin_mut().free_geometry(id);
+            if let Some(mut entity) = commands.get_entity(entity) {
+                entity.remove::<AudioGeometryInstance>();
+            }
+        }
+    }
+}
+
 //
 // reverb
 
@@ -1048,7 +2209,7 @@ fn add_reverb(
     new_reverbs: Query<(Entity, &AudioReverbSphere, &GlobalTransform), Added<AudioReverbSphere>>,
     mut mapping: ResMut<ReverbInstanceMapping>,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
+    let mut bridge = BRIDGE.write().unwrap();
     let bridge = bridge.as_mut().unwrap();
 
     for (entity, reverb, transform) in new_reverbs.iter() {
@@ -1082,7 +2243,7 @@ fn remove_reverb(
     mut removed: RemovedComponents<AudioReverbSphere>,
     mut mapping: ResMut<ReverbInstanceMapping>,
 ) {
-    let mut bridge = BRIDGE.lock().unwrap();
+    let mut bridge = BRIDGE.write().unwrap();
     let bridge = bridge.as_mut().unwrap();
 
     for entity in removed.read() {
@@ -1092,3 +2253,59 @@ fn remove_reverb(
         }
     }
 }
+
+//
+// diagnostics
+
+#[derive(Resource)]
+struct AudioDiagnosticsPaths {
+    /// Calls and time paths, in the same order as `BridgeStats::methods`
+    methods: Vec<(DiagnosticPath, DiagnosticPath)>,
+}
+
+/// Counters in stats are totals, so previous values are kept to report per-frame deltas
+fn update_diagnostics(
+    mut diagnostics: Diagnostics,
+    paths: Res<AudioDiagnosticsPaths>,
+    mut previous: Local<Option<bridge::BridgeStats>>,
+) {
+    let stats = BRIDGE
+        .write()
+        .unwrap()
+        .as_mut()
+        .unwrap()
+        .pin_mut()
+        .get_stats();
+
+    type P = AudioDiagnosticsPlugin;
+    diagnostics.add_measurement(&P::CPU_DSP, || stats.cpu_dsp as f64);
+    diagnostics.add_measurement(&P::CPU_STREAM, || stats.cpu_stream as f64);
+    diagnostics.add_measurement(&P::CPU_GEOMETRY, || stats.cpu_geometry as f64);
+    diagnostics.add_measurement(&P::CPU_UPDATE, || stats.cpu_update as f64);
+    diagnostics.add_measurement(&P::CHANNELS_PLAYING, || stats.channels_playing as f64);
+    diagnostics.add_measurement(&P::CHANNELS_REAL, || stats.channels_real as f64);
+    diagnostics.add_measurement(&P::MEMORY, || stats.memory_current as f64);
+
+    if let Some(previous) = previous.as_ref() {
+        let delta = |current: i64, previous: i64| (current - previous).max(0) as f64;
+        diagnostics.add_measurement(&P::SAMPLE_BYTES_READ, || {
+            delta(stats.sample_bytes_read, previous.sample_bytes_read)
+        });
+        diagnostics.add_measurement(&P::STREAM_BYTES_READ, || {
+            delta(stats.stream_bytes_read, previous.stream_bytes_read)
+        });
+        diagnostics.add_measurement(&P::OTHER_BYTES_READ, || {
+            delta(stats.other_bytes_read, previous.other_bytes_read)
+        });
+
+        let methods = stats.methods.iter().zip(&previous.methods);
+        for ((current, previous), (calls, time)) in methods.zip(&paths.methods) {
+            diagnostics.add_measurement(calls, || (current.calls - previous.calls) as f64);
+            diagnostics.add_measurement(time, || {
+                (current.total_ns - previous.total_ns) as f64 / 1_000_000.
+            });
+        }
+    }
+
+    *previous = Some(stats);
+}